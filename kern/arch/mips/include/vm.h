@@ -66,6 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -114,6 +115,7 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	unsigned ts_npages;	/* pages from ts_vaddr; 0 for all of it */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -151,6 +151,11 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/* Remember the user sp; vm_fault uses it to grow the stack. */
+	if (!iskern) {
+		curthread->t_machdep.tm_usersp = tf->tf_sp;
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
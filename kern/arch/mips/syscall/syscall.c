@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include <opt-A2.h>
+#include <opt-A3.h>
 #if OPT_A2
 #include <synch.h>
 #include <proc.h>
@@ -145,6 +146,20 @@ syscall(struct trapframe *tf)
 		err = sys_fork(tf, (pid_t *)&retval);
 		break;
 	#endif
+
+	#if OPT_A3
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+	case SYS_mmap:
+		err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			       (int)tf->tf_a2, (int)tf->tf_a3,
+			       (vaddr_t *)&retval);
+		break;
+	case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+	#endif
  
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
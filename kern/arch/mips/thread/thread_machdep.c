@@ -40,6 +40,7 @@ void
 thread_machdep_init(struct thread_machdep *tm)
 {
 	tm->tm_badfaultfunc = NULL;
+	tm->tm_usersp = 0;
 }
 
 void
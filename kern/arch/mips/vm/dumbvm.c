@@ -27,148 +27,1591 @@
  * SUCH DAMAGE.
  */
 
+#define ADDRSPACEINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
+#include <limits.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <clock.h>
+#include <wchan.h>
 #include <proc.h>
+#include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kmem_cache.h>
+#include <swap.h>
+#include <textcache.h>
+#include <zeropool.h>
+#include <uw-vmstats.h>
 #include <opt-A3.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground.
+ *
+ * With OPT_A3 this is replaced by a paged VM: each address space has a
+ * two-level page table (see pagetable.h) and a list of regions, and
+ * physical pages are only allocated when a page is first touched.
+ * When memory runs out, pages are evicted to swap (see swap.h) using
+ * the clock in the coremap.
+ */
+
+/*
+ * under dumbvm, always have 48k of user stack
+ * (with OPT_A3 the stack grows on demand up to STACK_MAX)
+ */
+#define DUMBVM_STACKPAGES    12
+
+/*
+ * Wrap rma_stealmem in a spinlock.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+
+#if OPT_A3
+/*
+ * vm_lock protects the contents of page table entries and the owner
+ * information in the coremap; it is taken before the coremap's own
+ * lock. A page being evicted is marked PTE_BUSY, and anyone who needs
+ * it waits on vm_busy_wchan until it's done.
+ *
+ * Evictions are serialized by vm_evict_lock, which keeps the clock
+ * sane.
+ */
+static struct spinlock vm_lock = SPINLOCK_NAMED_INITIALIZER("vm");
+static struct wchan *vm_busy_wchan;
+static struct lock *vm_evict_lock;
+
+/* How many pages we'll evict per page wanted before giving up. */
+#define VM_EVICT_TRIES	16
+
+/* Default fault-around window, in pages on each side. */
+#define VM_FAULTAROUND_DEFAULT	4
+
+static bool vm_can_evict(void);
+static int vm_evict(void);
+static paddr_t vm_getuserpage(void);
+static void vm_asid_activate(struct addrspace *as);
+#endif
+
+void
+vm_bootstrap(void)
+{
+	#if OPT_A3
+	coremap_bootstrap();
+	vmstats_init();
+
+	vm_busy_wchan = wchan_create("vmbusy");
+	if (vm_busy_wchan == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+	vm_evict_lock = lock_create("vmevict");
+	if (vm_evict_lock == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+
+	swap_bootstrap();
+	#else
+	/* Do nothing. */
+	#endif
+}
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+	#if OPT_A3
+
+	if (coremap_ready()) {
+		/*
+		 * If memory is short, take back what the kernel's own
+		 * caches are holding; that never sleeps, and never runs
+		 * a cache's destructors (see kmem_cache_reap). Nothing
+		 * here pages out: kernel allocations can come from
+		 * anywhere, including with VFS or filesystem locks held,
+		 * so doing I/O is left to vm_getuserpage and anyone else
+		 * fails.
+		 */
+		while (1) {
+			addr = coremap_alloc(npages);
+			if (addr != 0) {
+				return addr;
+			}
+			if (!zeropool_reclaim() && !kmem_cache_reap() &&
+			    !kheap_reclaim()) {
+				return 0;
+			}
+		}
+	}
+	#endif
+
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+	
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	#if OPT_A3
+	coremap_free(KVADDR_TO_PADDR(addr));
+	#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+	#endif
+}
+
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+void
+as_activate(void)
+{
+	int spl;
+	#if !OPT_A3
+	int i;
+	#endif
+	struct addrspace *as;
+
+	as = curproc_getas();
+#ifdef UW
+        /* Kernel threads don't have an address spaces to activate */
+#endif
+	if (as == NULL) {
+		return;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	#if OPT_A3
+	vm_asid_activate(as);
+	#else
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	#endif
+
+	splx(spl);
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
+
+#if OPT_A3
+
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of their address space, so
+ * switching between processes doesn't require a flush. ASIDs are
+ * handed out in order from a global counter and stamped with the
+ * current generation. When they run out a new generation starts: all
+ * existing ASIDs become stale, address spaces get new ones the next
+ * time they are activated, and each CPU flushes its TLB the first time
+ * it activates an address space in the new generation.
+ *
+ * A new generation doesn't retire the old ASIDs right away: a CPU
+ * still running an address space keeps its old ASID, and its TLB
+ * entries stay live, until it next activates something. So as_cpus
+ * survives a rollover and is only reset when the address space is
+ * given a new ASID. That happens when its thread activates it, so no
+ * CPU is still running under the old ASID by then; each one flushes
+ * before it runs anything in the new generation, and ASIDs aren't
+ * reused within a generation.
+ */
+static struct spinlock asid_lock = SPINLOCK_NAMED_INITIALIZER("asid");
+static uint32_t asid_generation = 1;	/* 0 means "no ASID yet" */
+static uint32_t asid_next = 0;
+
+#define TLBHI_ASID(as, vaddr)	((vaddr) | ((as)->as_asid << TLBHI_PIDSHIFT))
+
+/*
+ * Make AS the one the TLB on this CPU matches against. Call at
+ * splhigh.
+ */
+static
+void
+vm_asid_activate(struct addrspace *as)
+{
+	uint32_t asid;
+	bool flush;
+	int i;
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_ASID) {
+			asid_generation++;
+			asid_next = 0;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+		as->as_cpus = 0;
+	}
+	KASSERT(curcpu->c_number < 32);
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	asid = as->as_asid;
+	flush = (curcpu->c_tlbgen != asid_generation);
+	curcpu->c_tlbgen = asid_generation;
+	spinlock_release(&asid_lock);
+
+	if (flush) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+	tlb_setasid(asid);
+}
+
+/* Past this many pages it's cheaper to look at every TLB entry. */
+#define TLB_PROBE_MAX	8
+
+/*
+ * Drop the translations for NPAGES pages from VADDR in AS from this
+ * CPU's TLB, if present; if NPAGES is 0, drop all of AS's.
+ */
+static
+void
+tlb_invalidate(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	uint32_t ehi, elo;
+	vaddr_t end;
+	int i, spl;
+
+	end = vaddr + npages * PAGE_SIZE;
+
+	spl = splhigh();
+	if (npages != 0 && npages <= TLB_PROBE_MAX) {
+		for (; vaddr < end; vaddr += PAGE_SIZE) {
+			i = tlb_probe(TLBHI_ASID(as, vaddr), 0);
+			if (i >= 0) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(),
+					  i);
+			}
+		}
+	}
+	else {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) == 0 ||
+			    (ehi & TLBHI_PID) != TLBHI_ASID(as, 0)) {
+				continue;
+			}
+			if (npages != 0 && ((ehi & TLBHI_VPAGE) < vaddr ||
+					    (ehi & TLBHI_VPAGE) >= end)) {
+				continue;
+			}
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+	vmstats_inc(VMSTAT_TLB_SHOOTDOWN_ALL);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	tlb_invalidate(ts->ts_addrspace, ts->ts_vaddr, ts->ts_npages);
+}
+
+/*
+ * Remove the translations for NPAGES pages from VADDR in AS (all of
+ * them if NPAGES is 0) from every TLB, and wait until that has
+ * happened. Only the CPUs that have run AS under its
+ * current ASID can have the entry. That holds even if the ASID has
+ * gone stale, since a CPU still running AS keeps using it (see
+ * above). On a CPU that has since flushed, the probe misses, or at
+ * worst drops an entry the same ASID now has in a later generation,
+ * which just costs a refault.
+ */
+static
+void
+vm_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown ts;
+	uint32_t cpus;
+	time_t s1, s2;
+	uint32_t ns1, ns2;
+	unsigned n;
+
+	spinlock_acquire(&asid_lock);
+	cpus = as->as_cpus;
+	spinlock_release(&asid_lock);
+	if (cpus == 0) {
+		return;
+	}
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = npages;
+	gettime(&s1, &ns1);
+	n = ipi_tlbshootdown_cpus(cpus, &ts);
+	gettime(&s2, &ns2);
+
+	vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+	vmstats_add(VMSTAT_TLB_SHOOTDOWN_IPI, n);
+	vmstats_add(VMSTAT_TLB_SHOOTDOWN_USEC,
+		    (s2 - s1) * 1000000 + ns2 / 1000 - ns1 / 1000);
+}
+
+/*
+ * Sleep until some busy page stops being busy. Call with vm_lock
+ * held; it is released.
+ */
+static
+void
+vm_wait_busy(void)
+{
+	wchan_lock(vm_busy_wchan);
+	spinlock_release(&vm_lock);
+	wchan_sleep(vm_busy_wchan);
+}
+
+/*
+ * True if we're in a context where vm_evict can sleep: not in an
+ * interrupt, no spinlocks held, and not already evicting. A fault
+ * taken while copying to or from user space inside a filesystem
+ * operation holds the VFS big lock; paging out from there would go
+ * back into the VFS (dropping a text vnode may reclaim it), so don't.
+ */
+static
+bool
+vm_can_evict(void)
+{
+	return vm_evict_lock != NULL &&
+		curthread != NULL &&
+		!curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0 &&
+		!lock_do_i_hold(vm_evict_lock) &&
+		!vfs_biglock_do_i_hold();
+}
+
+/*
+ * Get a frame for a user page, paging out if memory is short. Only for
+ * the fault and fork paths, which hold no VFS or filesystem locks of
+ * their own; getppages doesn't do I/O. Returns 0 if nothing could be
+ * freed.
+ */
+static
+paddr_t
+vm_getuserpage(void)
+{
+	paddr_t paddr;
+	unsigned tries;
+
+	for (tries = 0; ; tries++) {
+		paddr = getppages(1);
+		if (paddr != 0) {
+			return paddr;
+		}
+		if (tries >= VM_EVICT_TRIES || !vm_can_evict()) {
+			return 0;
+		}
+		if (textcache_reclaim()) {
+			/* Cheaper than paging anything out. */
+			continue;
+		}
+		if (vm_evict()) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * Page out one user page chosen by the coremap clock and free its
+ * frame. Dirty pages are written to swap; clean ones are simply
+ * dropped, since they can be zero-filled again. Returns ENOMEM if no
+ * page can be evicted.
+ */
+static
+int
+vm_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte;
+	unsigned slot;
+	bool haveslot, dirty;
+	int result;
+
+	lock_acquire(vm_evict_lock);
+
+	/* With a slot in hand, dirty pages are fair game too. */
+	haveslot = (swap_alloc(&slot) == 0);
+
+	spinlock_acquire(&vm_lock);
+	paddr = coremap_victim(haveslot, &as, &vaddr, &dirty);
+	if (paddr == 0) {
+		spinlock_release(&vm_lock);
+		if (haveslot) {
+			swap_free(slot);
+		}
+		lock_release(vm_evict_lock);
+		return ENOMEM;
+	}
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_VALID | PTE_BUSY)) == PTE_VALID);
+	KASSERT((*pte & PTE_FRAME) == paddr);
+	*pte |= PTE_BUSY;
+	spinlock_release(&vm_lock);
+
+	DEBUG(DB_VM, "vm: evicting 0x%x (%s) from %p\n", vaddr,
+	      dirty ? "dirty" : "clean", as);
+
+	vm_shootdown(as, vaddr, 1);
+
+	if (dirty) {
+		result = swap_out(paddr, slot);
+		if (result) {
+			/* Leave the page where it was. */
+			spinlock_acquire(&vm_lock);
+			*pte &= ~PTE_BUSY;
+			coremap_touch(paddr, as, vaddr, true);
+			spinlock_release(&vm_lock);
+			wchan_wakeall(vm_busy_wchan);
+
+			swap_free(slot);
+			lock_release(vm_evict_lock);
+			return result;
+		}
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+
+	spinlock_acquire(&vm_lock);
+	*pte = dirty ? (SWAPSLOT_TO_PTE(slot) | PTE_SWAPPED) : 0;
+	coremap_disown(paddr);
+	spinlock_release(&vm_lock);
+	wchan_wakeall(vm_busy_wchan);
+
+	if (haveslot && !dirty) {
+		swap_free(slot);
+	}
+	free_kpages(PADDR_TO_KVADDR(paddr));
+
+	lock_release(vm_evict_lock);
+	return 0;
+}
+
+/*
+ * Return the region of AS containing VADDR, or NULL if there isn't one.
+ */
+static
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The stack starts out one page long, and grows down, up to STACK_MAX
+ * bytes below USERSTACK, to cover a fault in the page just below it
+ * or not far below the user sp. A stray pointer further down still
+ * faults. The sp is the one saved at the thread's last trap from user
+ * mode, which for a copyin/copyout is the syscall's. Until the
+ * program first traps (while execv is copying its arguments out,
+ * say) there's no sp to go by, and any fault in range grows the
+ * stack.
+ *
+ * It doesn't grow into another region or right up against one; the
+ * page in between is left unmapped to catch overflows. Nothing is
+ * allocated here; the new pages are zero-filled as they're touched.
+ *
+ * Returns the stack region if it now covers VADDR, or NULL.
+ */
+#define STACK_GROW_SLACK	PAGE_SIZE	/* how far below sp is ok */
+
+static
+struct region *
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack, *rg;
+	vaddr_t base, sp;
+	unsigned i, num;
+
+	stack = as->as_stack;
+	if (stack == NULL || vaddr >= stack->rg_vbase ||
+	    vaddr < USERSTACK - STACK_MAX) {
+		return NULL;
+	}
+	sp = curthread->t_machdep.tm_usersp;
+	if (sp != 0 && vaddr + STACK_GROW_SLACK < sp &&
+	    vaddr < stack->rg_vbase - PAGE_SIZE) {
+		return NULL;
+	}
+	base = vaddr & PAGE_FRAME;
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg != stack && rg->rg_vbase < stack->rg_vbase &&
+		    rg->rg_vbase + (rg->rg_npages + 1) * PAGE_SIZE > base) {
+			return NULL;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_vbase - base) / PAGE_SIZE;
+	stack->rg_vbase = base;
+	return stack;
+}
+
+/*
+ * Load a translation for VADDR in AS into the TLB. An existing entry
+ * (after a VM_FAULT_READONLY) is updated in place; otherwise a free
+ * slot is used if there is one, and a random entry is evicted if not.
+ *
+ * A PRELOAD (see vm_faultaround) leaves an existing entry alone and
+ * isn't counted as a fault in the vmstats. Returns false if nothing
+ * was loaded.
+ */
+static
+bool
+tlb_insert(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+	   bool writeable, bool preload)
+{
+	uint32_t ehi, elo, newhi, newlo;
+	int i, spl;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	newhi = TLBHI_ASID(as, vaddr);
+	newlo = paddr | TLBLO_VALID;
+	if (writeable) {
+		newlo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	i = tlb_probe(newhi, 0);
+	if (i >= 0) {
+		if (!preload) {
+			tlb_write(newhi, newlo, i);
+		}
+		splx(spl);
+		return !preload;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (elo & TLBLO_VALID) {
+			continue;
+		}
+		DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", vaddr, paddr);
+		tlb_write(newhi, newlo, i);
+		if (!preload) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+		splx(spl);
+		return true;
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x (replace)\n", vaddr, paddr);
+	tlb_random(newhi, newlo);
+	if (!preload) {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+	splx(spl);
+	return true;
+}
+
+/*
+ * Fault-around.
+ *
+ * On a TLB miss, translations for up to vm_faultaround resident pages
+ * on either side of the faulting one (in the same region) are loaded
+ * too, so that a sweep through memory doesn't take a trap per page.
+ * They are loaded without touching the coremap, so pages that are
+ * never used don't look referenced to the clock. Pages that are
+ * already dirty and not shared are loaded writeable, so a write sweep
+ * doesn't fault either; the rest are read-only, so that the first
+ * write still faults and marks the page dirty (or copies it).
+ *
+ * The MIPS TLB has no referenced bit, so there's no telling which
+ * preloads were used; the vmstats only count how many were made.
+ */
+unsigned vm_faultaround = VM_FAULTAROUND_DEFAULT;
+
+/* Past half the TLB, preloads would mostly push each other out. */
+#define VM_FAULTAROUND_MAX	(NUM_TLB / 2)
+
+int
+vm_setfaultaround(int pages)
+{
+	if (pages < 0 || pages > VM_FAULTAROUND_MAX) {
+		return EINVAL;
+	}
+	vm_faultaround = pages;
+	return 0;
+}
+
+/*
+ * Preload the neighbours of VADDR in region RG of AS. Call with
+ * vm_lock held.
  */
+static
+void
+vm_faultaround_load(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	vaddr_t lo, hi, va;
+	paddr_t paddr;
+	bool writeable;
+	pte_t *pte;
+
+	lo = rg->rg_vbase;
+	if (vaddr - lo > vm_faultaround * PAGE_SIZE) {
+		lo = vaddr - vm_faultaround * PAGE_SIZE;
+	}
+	hi = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	if (hi - vaddr > (vm_faultaround + 1) * PAGE_SIZE) {
+		hi = vaddr + (vm_faultaround + 1) * PAGE_SIZE;
+	}
+
+	for (va = lo; va < hi; va += PAGE_SIZE) {
+		if (va == vaddr) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || (*pte & (PTE_VALID | PTE_BUSY)) != PTE_VALID) {
+			continue;
+		}
+		paddr = *pte & PTE_FRAME;
+		writeable = rg->rg_writeable && coremap_writeable(paddr, as);
+		if (tlb_insert(as, va, paddr, writeable, true)) {
+			vmstats_inc(VMSTAT_FAULTAROUND_PRELOAD);
+			if (writeable) {
+				vmstats_inc(VMSTAT_FAULTAROUND_WRITEABLE);
+			}
+		}
+	}
+}
+
+/*
+ * Work out which part of the page at VADDR in region RG comes from
+ * the file: [*START, *END). Returns false if none of it does.
+ */
+static
+bool
+vm_filespan(struct region *rg, vaddr_t vaddr, vaddr_t *start, vaddr_t *end)
+{
+	KASSERT(rg->rg_vnode != NULL);
+
+	*start = vaddr;
+	if (*start < rg->rg_filebase) {
+		*start = rg->rg_filebase;
+	}
+	*end = vaddr + PAGE_SIZE;
+	if (*end > rg->rg_filebase + rg->rg_filesz) {
+		*end = rg->rg_filebase + rg->rg_filesz;
+	}
+	return *start < *end;
+}
+
+/*
+ * Fill the frame at PADDR with the page at VADDR in the file-backed
+ * region RG. Whatever part of the page the file covers is read in and
+ * the rest is zeroed. Returns ENOENT, without touching the frame, if
+ * the file covers none of the page.
+ */
+static
+int
+vm_readpage(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t start, end;
+	char *kva;
+	int result;
+
+	if (!vm_filespan(rg, vaddr, &start, &end)) {
+		return ENOENT;
+	}
+
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kva, start - vaddr);
+	bzero(kva + (end - vaddr), vaddr + PAGE_SIZE - end);
+
+	uio_kinit(&iov, &u, kva + (start - vaddr), end - start,
+		  rg->rg_offset + (start - rg->rg_filebase), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* load_elf checked the size, so it changed under us. */
+		kprintf("vm: short read on executable\n");
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Get the page at VADDR in the read-only file-backed region RG, which
+ * START and END say has file data in it, through the text page cache
+ * so that every process running the same program shares one copy.
+ * The frame is returned through RET with a reference for the caller.
+ *
+ * The cache key is the file offset of the start of the page plus the
+ * part of the page the file covers; the latter keeps apart the last
+ * page of one segment and the first of the next when they come from
+ * the same page of the file.
+ */
+static
+int
+vm_pagein_text(struct region *rg, vaddr_t vaddr, vaddr_t start, vaddr_t end,
+	       paddr_t *ret, unsigned *stat)
+{
+	paddr_t paddr, cached;
+	off_t offset;
+	int result;
+
+	offset = rg->rg_offset + ((off_t)vaddr - (off_t)rg->rg_filebase);
+
+	paddr = textcache_lookup(rg->rg_vnode, offset,
+				 start - vaddr, end - vaddr);
+	if (paddr != 0) {
+		/* Nothing was read or zeroed, so it counts as a reload. */
+		*stat = VMSTAT_TLB_RELOAD;
+		*ret = paddr;
+		return 0;
+	}
+
+	paddr = vm_getuserpage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = vm_readpage(rg, vaddr, paddr);
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	*stat = VMSTAT_PAGE_FAULT_DISK;
+
+	cached = textcache_insert(rg->rg_vnode, offset,
+				  start - vaddr, end - vaddr, paddr);
+	if (cached != paddr) {
+		/* Someone else read it in at the same time. */
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+	*ret = cached;
+	return 0;
+}
+
+/*
+ * Bring the non-resident page at VADDR (entry PTE, in region RG) into
+ * memory: from swap if it was paged out, from the file if RG is loaded
+ * from one (by way of the text page cache if RG is read-only), and as
+ * a zero-filled page otherwise. The kind of fault is
+ * returned through STAT for the vmstats.
+ *
+ * Only the thread that owns AS changes non-resident entries, so no
+ * locking is needed to look at *PTE before the page is in.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	  pte_t *pte, unsigned *stat)
+{
+	paddr_t paddr;
+	vaddr_t start, end;
+	pte_t old;
+	bool dirty;
+	int result;
+
+	old = *pte;
+	KASSERT((old & (PTE_VALID | PTE_BUSY)) == 0);
+
+	if (old & PTE_SWAPPED) {
+		paddr = vm_getuserpage();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_in(PTE_TO_SWAPSLOT(old), paddr);
+		if (result) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		*stat = VMSTAT_PAGE_FAULT_DISK;
+		/* The slot is given up, so memory is the only copy. */
+		dirty = true;
+	}
+	else if (rg->rg_vnode != NULL && !rg->rg_writeable &&
+		 vm_filespan(rg, vaddr, &start, &end)) {
+		/* Program text: shared, so never evicted or dirtied. */
+		result = vm_pagein_text(rg, vaddr, start, end, &paddr, stat);
+		if (result) {
+			return result;
+		}
+		dirty = false;
+	}
+	else if (rg->rg_vnode != NULL && vm_filespan(rg, vaddr, &start, &end)) {
+		/* Private copy of writeable file data. */
+		paddr = vm_getuserpage();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = vm_readpage(rg, vaddr, paddr);
+		if (result) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		*stat = VMSTAT_PAGE_FAULT_DISK;
+		/* It can be read in again if it's evicted as is. */
+		dirty = false;
+	}
+	else {
+		/* Zero-fill; idle cpus have usually done the zeroing. */
+		paddr = zeropool_get();
+		if (paddr == 0) {
+			paddr = vm_getuserpage();
+			if (paddr == 0) {
+				return ENOMEM;
+			}
+			as_zero_region(paddr, 1);
+		}
+		*stat = VMSTAT_PAGE_FAULT_ZERO;
+		/* Likewise, it can be recreated if it's evicted as is. */
+		dirty = false;
+	}
+
+	spinlock_acquire(&vm_lock);
+	KASSERT(*pte == old);
+	*pte = paddr | PTE_VALID;
+	coremap_touch(paddr, as, vaddr, dirty);
+	spinlock_release(&vm_lock);
+
+	if (old & PTE_SWAPPED) {
+		swap_free(PTE_TO_SWAPSLOT(old));
+	}
+	return 0;
+}
+
+/*
+ * Copy-on-write: give AS its own copy of the shared frame OLDPA mapped
+ * at VADDR by PTE, which is about to be written to.
+ *
+ * Shared frames have no owner and so can't be evicted, and only the
+ * thread that owns AS changes its entries, so *PTE can't change under
+ * us. If the other sharers let go in the meantime the copy wasn't
+ * needed, but it's still correct.
+ */
+static
+int
+vm_unshare(struct addrspace *as, vaddr_t vaddr, pte_t *pte, paddr_t oldpa)
+{
+	paddr_t newpa;
+
+	newpa = vm_getuserpage();
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa),
+		PAGE_SIZE);
+
+	spinlock_acquire(&vm_lock);
+	KASSERT((*pte & PTE_FRAME) == oldpa);
+	*pte = newpa | PTE_VALID;
+	coremap_touch(newpa, as, vaddr, true);
+	spinlock_release(&vm_lock);
+
+	/* Drop our reference to the shared frame. */
+	free_kpages(PADDR_TO_KVADDR(oldpa));
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	paddr_t paddr;
+	bool writeable, write;
+	unsigned stat;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		rg = as_grow_stack(as, faultaddress);
+	}
+	if (rg == NULL || !rg->rg_readable) {
+		return EFAULT;
+	}
+
+	/* Nothing is written in by load_elf, so text is never writeable. */
+	writeable = rg->rg_writeable;
+
+	/*
+	 * VM_FAULT_READONLY is a write to a page we mapped read-only.
+	 * Either the region really is read-only, or the page is shared
+	 * copy-on-write or still clean; the latter cases are handled
+	 * just like a write miss.
+	 */
+	write = (faulttype != VM_FAULT_READ);
+	if (write && !writeable) {
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	stat = VMSTAT_TLB_RELOAD;
+	while (1) {
+		spinlock_acquire(&vm_lock);
+		if (*pte & PTE_BUSY) {
+			/* Being paged out; wait and look again. */
+			vm_wait_busy();
+			continue;
+		}
+
+		if ((*pte & PTE_VALID) == 0) {
+			spinlock_release(&vm_lock);
+			result = vm_pagein(as, rg, faultaddress, pte, &stat);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		paddr = *pte & PTE_FRAME;
+		if (write && coremap_refcount(paddr) > 1) {
+			spinlock_release(&vm_lock);
+			result = vm_unshare(as, faultaddress, pte, paddr);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		/*
+		 * Map the page writeable only if it's already dirty, so
+		 * the first write to a clean page faults and marks it.
+		 *
+		 * The TLB is loaded with vm_lock held so that an eviction
+		 * can't slip in before its shootdown would see the entry.
+		 */
+		if (!coremap_touch(paddr, as, faultaddress, write)) {
+			writeable = false;
+		}
+		if (faulttype != VM_FAULT_READONLY && vm_faultaround > 0) {
+			/* First, so they can't push this one out. */
+			vm_faultaround_load(as, rg, faultaddress);
+		}
+		tlb_insert(as, faultaddress, paddr, writeable, false);
+		spinlock_release(&vm_lock);
+		break;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(stat);
+	}
+	return 0;
+}
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	regionarray_init(&as->as_regions);
+	as->as_stack = NULL;
+	as->as_heap = NULL;
+	as->as_brk = 0;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+
+	return as;
+}
+
+/*
+ * pt_walk callback for as_destroy: release one page, resident or in
+ * swap.
+ */
+static
+int
+as_free_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	pte_t old;
+
+	(void)vaddr;
+	(void)data;
+
+	spinlock_acquire(&vm_lock);
+	while (*pte & PTE_BUSY) {
+		vm_wait_busy();
+		spinlock_acquire(&vm_lock);
+	}
+	old = *pte;
+	*pte = 0;
+	if (old & PTE_VALID) {
+		coremap_disown(old & PTE_FRAME);
+	}
+	spinlock_release(&vm_lock);
+
+	if (old & PTE_VALID) {
+		free_kpages(PADDR_TO_KVADDR(old & PTE_FRAME));
+	}
+	else if (old & PTE_SWAPPED) {
+		swap_free(PTE_TO_SWAPSLOT(old));
+	}
+	return 0;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned i, num;
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
+	pt_walk(as->as_pt, as_free_page, NULL);
+	pt_destroy(as->as_pt);
+
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+	regionarray_setsize(&as->as_regions, 0);
+	regionarray_cleanup(&as->as_regions);
+
+	kfree(as);
+}
 
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Add an anonymous region covering [VADDR, VADDR+SZ) to AS, rounded
+ * out to whole pages. The new region is handed back in RET if that's
+ * not NULL.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	      bool writeable, struct region **ret)
+{
+	struct region *rg;
+	int result;
 
-#if OPT_A3
-static unsigned int core_map_lo;
-static unsigned int core_map_hi;
-static unsigned int core_map_npages;
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
 
-static bool core_map_created = false;
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-static struct spinlock core_map_lock = SPINLOCK_INITIALIZER;
-#endif
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = sz / PAGE_SIZE;
+	rg->rg_writeable = writeable;
+	rg->rg_readable = true;
+	rg->rg_mapped = false;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_filebase = vaddr;
+	rg->rg_filesz = 0;
+
+	result = regionarray_add(&as->as_regions, rg, NULL);
+	if (result) {
+		kfree(rg);
+		return result;
+	}
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
 
-void
-vm_bootstrap(void)
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
 {
-	#if OPT_A3
+	struct region *heap, *rg;
+	vaddr_t newbreak, top, end, vaddr;
+	unsigned npages, i, num;
+	pte_t *pte;
 
-	ram_getsize(&core_map_lo, &core_map_hi);
+	KASSERT(as == curproc_getas());
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return ENOMEM;
+	}
 
-	core_map_npages = (core_map_hi - core_map_lo) / PAGE_SIZE;
+	/* Room for the stack to grow to its limit is never given out. */
+	top = USERSTACK - STACK_MAX - PAGE_SIZE;
 
-	for (unsigned int i = 0; i < core_map_npages; i++) {
-		*((unsigned char *)(PADDR_TO_KVADDR(core_map_lo)) + i) = 0;
+	if (amount < 0) {
+		if (0 - (vaddr_t)amount > as->as_brk - heap->rg_vbase) {
+			return EINVAL;
+		}
+	}
+	else if (as->as_brk > top || (vaddr_t)amount > top - as->as_brk) {
+		return ENOMEM;
+	}
+	newbreak = as->as_brk + amount;
+	npages = (newbreak - heap->rg_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	end = heap->rg_vbase + npages * PAGE_SIZE;
+
+	/* Leave an unmapped page before whatever comes next. */
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg != heap && rg->rg_vbase >= heap->rg_vbase &&
+		    rg->rg_vbase < end + PAGE_SIZE) {
+			return ENOMEM;
+		}
 	}
 
-	core_map_created = true;
+	vaddr = heap->rg_vbase + heap->rg_npages * PAGE_SIZE;
+	heap->rg_npages = npages;
 
-	#else
-	/* Do nothing. */
-	#endif
+	if (end < vaddr) {
+		/* Drop any TLB entries for the pages going away. */
+		vm_shootdown(as, end, (vaddr - end) / PAGE_SIZE);
+
+		for (; end < vaddr; end += PAGE_SIZE) {
+			pte = pt_lookup(as->as_pt, end, false);
+			if (pte != NULL && *pte != 0) {
+				as_free_page(end, pte, NULL);
+			}
+		}
+	}
+
+	*oldbreak = as->as_brk;
+	as->as_brk = newbreak;
+	return 0;
 }
 
+/*
+ * Find room for a mapping of LEN bytes, as high as possible below the
+ * space kept for the stack, with an unmapped page on either side.
+ */
 static
-paddr_t
-getppages(unsigned long npages)
+int
+as_find_gap(struct addrspace *as, size_t len, vaddr_t *ret)
 {
-	paddr_t addr;
-	#if OPT_A3
-	if (core_map_created) {
-		spinlock_acquire(&core_map_lock);
-
-		unsigned int i = 0;
-
-		/*Use core-map version 2*/
-		while (i < core_map_npages) {
-			unsigned int j = i;
-			unsigned int current_entry = *((unsigned char *)(PADDR_TO_KVADDR(core_map_lo)) + i);
-			unsigned int page_count = 0;
-
-			bool completed = false;
-
-			while (current_entry == 0 &&
-				j + page_count < core_map_npages) {
-				page_count += 1;
-
-				/* If the pointer has reached the core_map entry specified by npages*/
-				if (page_count == npages) {
-					i = j;
-
-					/* Set the core_map entries to incrementing values */
-					for (unsigned int k = 1; k < npages + 1; k++) {
-						*((unsigned char *)(PADDR_TO_KVADDR(core_map_lo)) + i) = k;
-						i++;
-					}
-
-					addr = core_map_lo + j*PAGE_SIZE;
-					completed = true;
-					break;
-				}
-				if (completed) break;
-				i++;
-				current_entry = *((unsigned char *)(PADDR_TO_KVADDR(core_map_lo)) + i);
+	struct region *rg;
+	vaddr_t top, base;
+	unsigned i, num;
+	bool moved;
+
+	top = USERSTACK - STACK_MAX;
+	num = regionarray_num(&as->as_regions);
+	do {
+		if (top < len + 2 * PAGE_SIZE) {
+			return ENOMEM;
+		}
+		base = top - PAGE_SIZE - len;
+		moved = false;
+		for (i=0; i<num; i++) {
+			rg = regionarray_get(&as->as_regions, i);
+			if (rg->rg_vbase < top &&
+			    rg->rg_vbase + (rg->rg_npages + 1) * PAGE_SIZE > base) {
+				/* In the way; try just below it. */
+				top = rg->rg_vbase;
+				moved = true;
+				break;
 			}
-			if (completed) break;
+		}
+	} while (moved);
+
+	*ret = base;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, size_t len, int prot, int flags, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t vaddr;
+	int result;
+
+	/* Anonymous private memory is all there is. */
+	if (flags != (MAP_PRIVATE | MAP_ANON)) {
+		return EINVAL;
+	}
+	if (len == 0) {
+		return EINVAL;
+	}
+	if (len > USERSTACK) {
+		return ENOMEM;
+	}
+	len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	result = as_find_gap(as, len, &vaddr);
+	if (result) {
+		return result;
+	}
+	result = as_add_region(as, vaddr, len, (prot & PROT_WRITE) != 0, &rg);
+	if (result) {
+		return result;
+	}
+	rg->rg_mapped = true;
+	/* MIPS can't have write-only or execute-only pages. */
+	rg->rg_readable = (prot != PROT_NONE);
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	vaddr_t end, rgend, va;
+	unsigned i;
+	pte_t *pte;
+
+	KASSERT(as == curproc_getas());
+
+	if (vaddr % PAGE_SIZE != 0 || len == 0 || len > USERSTACK - vaddr) {
+		return EINVAL;
+	}
+	end = vaddr + len;
+
+	/* Only whole mappings can be removed. */
+	for (i=0; i<regionarray_num(&as->as_regions); i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_vbase < end && rgend > vaddr &&
+		    (!rg->rg_mapped || rg->rg_vbase < vaddr || rgend > end)) {
+			return EINVAL;
+		}
+	}
+
+	i = 0;
+	while (i < regionarray_num(&as->as_regions)) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vbase < vaddr || rg->rg_vbase >= end) {
 			i++;
+			continue;
+		}
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		regionarray_remove(&as->as_regions, i);
+
+		vm_shootdown(as, rg->rg_vbase, rg->rg_npages);
+		for (va = rg->rg_vbase; va < rgend; va += PAGE_SIZE) {
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte != NULL && *pte != 0) {
+				as_free_page(va, pte, NULL);
+			}
 		}
+		kfree(rg);
+	}
+	return 0;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	/* Everything mapped is readable, and MIPS can't forbid execute. */
+	(void)readable;
+	(void)executable;
 
-		spinlock_release(&core_map_lock);
-	} else {
-		spinlock_acquire(&stealmem_lock);
+	return as_add_region(as, vaddr, sz, writeable != 0, NULL);
+}
 
-		addr = ram_stealmem(npages);
-	
-		spinlock_release(&stealmem_lock);
+int
+as_define_segment(struct addrspace *as, vaddr_t vaddr, size_t memsz,
+		  struct vnode *v, off_t offset, size_t filesz,
+		  int readable, int writeable, int executable)
+{
+	struct region *rg;
+	int result;
+
+	KASSERT(filesz <= memsz);
+
+	(void)readable;
+	(void)executable;
+
+	result = as_add_region(as, vaddr, memsz, writeable != 0, &rg);
+	if (result) {
+		return result;
 	}
-	#else
-	spinlock_acquire(&stealmem_lock);
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	#endif
-	return addr;
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_offset = offset;
+	rg->rg_filebase = vaddr;
+	rg->rg_filesz = filesz;
+	return 0;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+int
+as_prepare_load(struct addrspace *as)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
+	/* Nothing to do: pages are read in as they are touched. */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg;
+	vaddr_t top;
+	unsigned i, num;
+
+	/* Put the (empty) heap right after everything that was loaded. */
+	top = 0;
+	num = regionarray_num(&as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > top) {
+			top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+	as->as_brk = top;
+	return as_add_region(as, top, 0, true, &as->as_heap);
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	/* The rest is added as it's touched; see as_grow_stack. */
+	result = as_add_region(as, USERSTACK - PAGE_SIZE, PAGE_SIZE, true,
+			       &as->as_stack);
+	if (result) {
+		return result;
+	}
+
+	/* The old program's sp means nothing to the new one. */
+	KASSERT(as == curproc_getas());
+	curthread->t_machdep.tm_usersp = 0;
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+/*
+ * pt_walk callback for as_copy: share one page with the new address
+ * space (DATA). Resident pages are shared copy-on-write, and nothing is
+ * copied until one side writes to them; see vm_unshare. Pages in swap
+ * are read back into a frame of the child's own.
+ */
+static
+int
+as_share_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct addrspace *new = data;
+	pte_t *newpte;
+	paddr_t paddr;
+	int result;
+
+	newpte = pt_lookup(new->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&vm_lock);
+	while (*pte & PTE_BUSY) {
+		vm_wait_busy();
+		spinlock_acquire(&vm_lock);
+	}
+	if (*pte & PTE_VALID) {
+		paddr = *pte & PTE_FRAME;
+		coremap_share(paddr);
+		coremap_disown(paddr);
+		*newpte = *pte;
+		spinlock_release(&vm_lock);
 		return 0;
 	}
-	return PADDR_TO_KVADDR(pa);
+	spinlock_release(&vm_lock);
+
+	/* Only we change our non-resident entries; see vm_pagein. */
+	KASSERT(*pte & PTE_SWAPPED);
+
+	paddr = vm_getuserpage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = swap_in(PTE_TO_SWAPSLOT(*pte), paddr);
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+
+	spinlock_acquire(&vm_lock);
+	*newpte = paddr | PTE_VALID;
+	coremap_touch(paddr, new, vaddr, true);
+	spinlock_release(&vm_lock);
+	return 0;
 }
 
-void 
-free_kpages(vaddr_t addr)
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
 {
-	#if OPT_A3
-	/* Don't have time for this... */
-	#else
-	/* nothing - leak the memory. */
+	struct addrspace *new;
+	struct region *rg, *newrg;
+	unsigned i, num;
+	int result;
 
-	(void)addr;
-	#endif
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	num = regionarray_num(&old->as_regions);
+	for (i=0; i<num; i++) {
+		rg = regionarray_get(&old->as_regions, i);
+		result = as_add_region(new, rg->rg_vbase,
+				       rg->rg_npages * PAGE_SIZE,
+				       rg->rg_writeable, &newrg);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+		*newrg = *rg;
+		if (newrg->rg_vnode != NULL) {
+			VOP_INCREF(newrg->rg_vnode);
+		}
+		if (rg == old->as_stack) {
+			new->as_stack = newrg;
+		}
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+	}
+
+	new->as_brk = old->as_brk;
+
+	/* Share every resident page copy-on-write. */
+	result = pt_walk(old->as_pt, as_share_page, new);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * The parent may still have writeable TLB entries for pages
+	 * that are now shared, here or on any CPU it has run on. Drop
+	 * them all; its next write to each refaults and copies.
+	 */
+	vm_shootdown(old, 0, 0);
+
+	*ret = new;
+	return 0;
 }
 
+#else /* not OPT_A3 */
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -192,22 +1635,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	struct addrspace *as;
 	int spl;
 
-	#if OPT_A3
-	bool code_segment = false;
-	#endif
-
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		#if OPT_A3
-		return EFAULT;
-		#else
 		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
-		#endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -256,9 +1691,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
-		#if OPT_A3
-		code_segment = true;
-		#endif
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
@@ -283,36 +1715,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		#if OPT_A3
-		if (as->as_loaded && code_segment){
-			elo &= ~TLBLO_DIRTY;
-		}
-		#endif
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
-	#if OPT_A3
-
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	#if OPT_A3
-	if (as->as_loaded && code_segment){
-		elo &= ~TLBLO_DIRTY;
-	}
-	#endif
-	tlb_random(ehi, elo);
-	splx(spl);
-	return 0;
-
-	#else
 
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
-
-	#endif
 }
 
 struct addrspace *
@@ -330,9 +1741,6 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
-	#if OPT_A3
-	as->as_loaded = false;
-	#endif
 
 	return as;
 }
@@ -343,36 +1751,6 @@ as_destroy(struct addrspace *as)
 	kfree(as);
 }
 
-void
-as_activate(void)
-{
-	int i, spl;
-	struct addrspace *as;
-
-	as = curproc_getas();
-#ifdef UW
-        /* Kernel threads don't have an address spaces to activate */
-#endif
-	if (as == NULL) {
-		return;
-	}
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
-}
-
-void
-as_deactivate(void)
-{
-	/* nothing */
-}
-
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -412,13 +1790,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return EUNIMP;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -451,12 +1822,7 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	#if OPT_A3
-	as->as_loaded = true;
-	#else
 	(void)as;
-	#endif
-
 	return 0;
 }
 
@@ -468,7 +1834,6 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	*stackptr = USERSTACK;
 	return 0;
 }
-
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -509,3 +1874,5 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+
+#endif /* OPT_A3 */
@@ -41,6 +41,7 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
+#include <kmem_cache.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -49,6 +50,15 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/*
+ * Cache of vnode structures. Everything in them is set up afresh by
+ * sfs_loadvnode, so there's no constructor; this just saves going
+ * through kmalloc every time a file is opened.
+ */
+static struct kmem_cache sfs_vnode_cache =
+	KMEM_CACHE_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode),
+			       NULL, NULL, 16);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +963,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1685,7 +1695,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1709,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1746,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1757,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
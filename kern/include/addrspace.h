@@ -37,10 +37,44 @@
 
 #include <vm.h>
 #include <opt-A3.h>
+#if OPT_A3
+#include <array.h>
+#include <pagetable.h>
+#endif
 
 struct vnode;
 
 
+#if OPT_A3
+/*
+ * A region is a run of virtual pages with the same permissions: a
+ * segment from the executable, or the stack. Pages in a region get
+ * physical memory only when they are first touched.
+ *
+ * A region loaded from a file remembers where: the FILESZ bytes at
+ * OFFSET in the vnode appear at FILEBASE, and anything else in the
+ * region is zero-filled.
+ */
+struct region {
+  vaddr_t rg_vbase;             /* first address, page aligned */
+  size_t rg_npages;             /* length in pages */
+  bool rg_readable;             /* false for PROT_NONE mappings */
+  bool rg_writeable;            /* may user code write here? */
+  bool rg_mapped;               /* made by mmap, so munmap may remove it */
+  struct vnode *rg_vnode;       /* backing file, or NULL */
+  off_t rg_offset;              /* file offset of the data */
+  vaddr_t rg_filebase;          /* where the file data starts */
+  size_t rg_filesz;             /* bytes of file data */
+};
+
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(region);
+DEFARRAY(region, ADDRSPACEINLINE);
+#endif
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -49,6 +83,16 @@ struct vnode;
  */
 
 struct addrspace {
+#if OPT_A3
+  struct pagetable *as_pt;      /* virtual to physical translations */
+  struct regionarray as_regions; /* valid parts of the address space */
+  struct region *as_stack;      /* grows down on demand; see vm_fault */
+  struct region *as_heap;       /* after the data, moved by as_sbrk */
+  vaddr_t as_brk;               /* current end of the heap */
+  uint32_t as_asid;             /* TLB address space ID... */
+  uint32_t as_asidgen;          /* ...valid while this is current */
+  uint32_t as_cpus;             /* CPUs that may have it in the TLB */
+#else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -56,9 +100,7 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
-  #if OPT_A3
-  bool as_loaded;
-  #endif
+#endif
 };
 
 /*
@@ -86,6 +128,11 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_segment - like as_define_region, but the start of the
+ *                region is loaded from FILESZ bytes of the file V at
+ *                OFFSET the first time each page is touched. Keeps a
+ *                reference to V.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -95,6 +142,24 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, handing
+ *                back the old end. The heap starts empty, on the page
+ *                after the last region set up before as_complete_load.
+ *                Pages are allocated as they're touched and freed when
+ *                the heap shrinks past them. Must be called on the
+ *                current address space.
+ *
+ *    as_mmap   - add an anonymous mapping of LEN bytes, with
+ *                protection PROT, at an address of our choosing,
+ *                handed back through RET. FLAGS must be
+ *                MAP_PRIVATE|MAP_ANON; there are no file mappings.
+ *                Pages are zero-filled as they're touched, and
+ *                PROT_NONE pages can't be touched at all.
+ *
+ *    as_munmap - remove the mappings in the given range. Only whole
+ *                mappings made with as_mmap can be removed. Must be
+ *                called on the current address space.
  */
 
 struct addrspace *as_create(void);
@@ -108,6 +173,20 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+#if OPT_A3
+int               as_define_segment(struct addrspace *as,
+                                    vaddr_t vaddr, size_t memsz,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesz,
+                                    int readable,
+                                    int writeable,
+                                    int executable);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t len, int prot,
+                          int flags, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator (the coremap).
+ *
+ * There is one coremap entry for every physical page frame handed to
+ * the VM system by ram_getsize(). Free frames are managed with a
+ * binary buddy allocator: a free block of order k is 2^k frames long
+ * and starts on a 2^k frame boundary (counted from the first managed
+ * frame). Each order has its own free list, so allocation and free
+ * are O(log n) in the size of physical memory; freeing coalesces a
+ * block with its buddy for as long as the buddy is also free.
+ *
+ * Requests that are not a power of two are carved out of the next
+ * larger block and the unused tail is given back immediately, so an
+ * allocation of n pages costs exactly n pages.
+ *
+ * Each allocated block also carries a reference count, so that a frame
+ * can be shared between address spaces (copy-on-write after fork).
+ * coremap_alloc returns a block with one reference and coremap_free
+ * drops one; the block is only really freed when the last goes away.
+ */
+
+#include <machine/vm.h>
+
+/* Number of buddy orders; the largest block is 2^(COREMAP_NORDERS-1) pages. */
+#define COREMAP_NORDERS  17
+
+/* Call once from vm_bootstrap(), after ram_bootstrap(). */
+void coremap_bootstrap(void);
+
+/* True once coremap_bootstrap() has run. */
+bool coremap_ready(void);
+
+/*
+ * Allocate NPAGES physically contiguous frames. Returns the physical
+ * address of the first, or 0 if no suitable block is free.
+ */
+paddr_t coremap_alloc(unsigned long npages);
+
+/*
+ * Drop a reference to a block previously returned by coremap_alloc,
+ * freeing it if that was the last one. Frames that were taken with
+ * ram_stealmem() before the coremap existed are not managed and are
+ * silently ignored.
+ */
+void coremap_free(paddr_t paddr);
+
+/* Add a reference to the allocated block at PADDR. */
+void coremap_share(paddr_t paddr);
+
+/*
+ * Return the number of references to the allocated block at PADDR.
+ * Only meaningful to a caller that holds one of them.
+ */
+unsigned coremap_refcount(paddr_t paddr);
+
+/*
+ * Kernel allocators can hang a pointer of their own off a block they
+ * got from alloc_kpages (the subpage allocator keeps the page's pageref
+ * there), so they can find it again from an address in constant time.
+ * It starts out NULL and is cleared when the block is freed.
+ * coremap_getkdata takes no lock and returns NULL for anything that
+ * isn't the start of an allocated block, including frames stolen
+ * before the coremap existed.
+ */
+void coremap_setkdata(paddr_t paddr, void *data);
+void *coremap_getkdata(paddr_t paddr);
+
+/*
+ * Return the size in pages of the allocated block at PADDR, or 0 if
+ * PADDR isn't the start of a block the coremap manages.
+ */
+unsigned coremap_npages(paddr_t paddr);
+
+/*
+ * Page-out support.
+ *
+ * Single-page frames holding user pages can be given an owner, the
+ * address space and virtual page they back, which makes them
+ * candidates for eviction. Frames with more than one reference
+ * (copy-on-write) have no owner; the next coremap_touch after the
+ * count drops back to one claims the frame again.
+ *
+ *    coremap_touch  - record an access by AS to VADDR, which maps
+ *                     PADDR: set the referenced bit, set the dirty bit
+ *                     if WRITE, and claim ownership if possible.
+ *                     Returns true if the page may be mapped writeable,
+ *                     i.e. it is dirty and not shared.
+ *
+ *    coremap_writeable - true if PADDR is dirty, not shared, and owned
+ *                     by AS, so AS may map it writeable. Unlike
+ *                     coremap_touch, doesn't count as a reference.
+ *
+ *    coremap_disown - forget the owner of PADDR, e.g. because the
+ *                     mapping is going away or the page is now shared.
+ *
+ *    coremap_victim - run the clock and return an owned frame that
+ *                     hasn't been referenced since the hand last went
+ *                     by, or 0 if there isn't one. Dirty frames are
+ *                     skipped unless DIRTYOK. The owner and dirty bit
+ *                     are returned through AS, VADDR and DIRTY, and the
+ *                     frame is not chosen again until it is touched or
+ *                     disowned.
+ *
+ * The caller is responsible for keeping the owner consistent with its
+ * page tables.
+ */
+struct addrspace;
+bool coremap_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+		   bool write);
+bool coremap_writeable(paddr_t paddr, struct addrspace *as);
+void coremap_disown(paddr_t paddr);
+paddr_t coremap_victim(bool dirtyok, struct addrspace **as, vaddr_t *vaddr,
+		       bool *dirty);
+
+/* Print per-order free block counts (used by the "kh" menu command). */
+void coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
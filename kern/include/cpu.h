@@ -36,6 +36,12 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of scheduling priorities. Each cpu has a run queue for each
+ * one; 0 is the highest. See schedule() in thread.c.
+ */
+#define SCHED_NPRIO	4
+
 /*
  * Per-cpu structure
  *
@@ -60,13 +66,20 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	uint32_t c_tlbgen;		/* ASID generation TLB is clean for */
+	uint32_t c_stealseed;		/* For picking cpus to steal from */
+
+	/*
+	 * Accessed by other cpus, without a lock; it's only a hint.
+	 */
+	unsigned c_kickclock;		/* c_hardclocks when last kicked */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NPRIO]; /* Run queues, by priority */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -82,10 +95,17 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Each shootdown queued gets the next c_shootdown_seq as its
+	 * ticket; once c_shootdown_done has caught up with it, it has
+	 * been handled, and c_shootdown_wchan is woken.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;	/* Shootdowns queued so far */
+	unsigned c_shootdown_done;	/* Shootdowns handled so far */
+	struct wchan *c_shootdown_wchan;
 	struct spinlock c_ipi_lock;
 };
 
@@ -152,6 +172,14 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * Shootdowns queued while one is already pending go out with it, and
+ * past TLBSHOOTDOWN_MAX the target just flushes everything. Returns a
+ * ticket for ipi_tlbshootdown_wait.
+ * ipi_tlbshootdown_wait sleeps until TARGET has handled the shootdown
+ * with the given ticket.
+ * ipi_tlbshootdown_cpus handles a shootdown on every CPU in a mask of
+ * c_numbers: at once on this one, if it's included, and by IPI on the
+ * others, which it waits for. Returns how many IPIs that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,7 +193,11 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
+unsigned ipi_tlbshootdown_cpus(uint32_t cpus,
+			       const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -71,6 +71,9 @@
 /* Max bytes for atomic pipe I/O -- see description in the pipe() man page */
 #define __PIPE_BUF      512
 
+/* Max bytes the user stack may grow to (the stack rlimit) */
+#define __STACK_MAX     (8 * 1024 * 1024)
+
 
 /*
  * Not so important parts of the API.
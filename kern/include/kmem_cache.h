@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A cache hands out objects of one type that are already constructed.
+ * The constructor runs only when a fresh object has to be made with
+ * kmalloc; an object given back with kmem_cache_free must be in its
+ * constructed state again (locks unheld, lists empty, and so on), and
+ * up to the cache's retention limit it is kept as it is for the next
+ * kmem_cache_alloc instead of being torn down. The destructor runs
+ * when a retained object is finally freed, or when an object is given
+ * back to a cache that's already holding as many as it may.
+ *
+ * Caches are declared statically with KMEM_CACHE_INITIALIZER, so they
+ * can be used at any point during boot.
+ */
+
+#include <spinlock.h>
+
+/* Most objects any cache retains. */
+#define KMEM_CACHE_MAXFREE	32
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);	/* may be NULL; returns errno */
+	void (*kc_dtor)(void *obj);	/* may be NULL */
+	unsigned kc_maxfree;		/* retention limit */
+
+	struct spinlock kc_lock;	/* protects the fields below */
+	unsigned kc_nfree;
+	void *kc_free[KMEM_CACHE_MAXFREE];	/* constructed objects */
+	unsigned kc_hits;		/* allocations from kc_free */
+	unsigned kc_misses;		/* allocations that were constructed */
+
+	bool kc_listed;			/* on the list of all caches */
+	struct kmem_cache *kc_next;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor, maxfree) {	\
+		.kc_name = (name),					\
+		.kc_size = (size),					\
+		.kc_ctor = (ctor),					\
+		.kc_dtor = (dtor),					\
+		.kc_maxfree = (maxfree),				\
+		.kc_lock = SPINLOCK_INITIALIZER,			\
+	}
+
+/*
+ * Functions:
+ *
+ *    kmem_cache_alloc  - return a constructed object, or NULL if out of
+ *                        memory or the constructor failed.
+ *
+ *    kmem_cache_free   - give back an object from kmem_cache_alloc, in
+ *                        its constructed state.
+ *
+ *    kmem_cache_reap   - free every retained object in every cache
+ *                        that has no destructor, and ask the idle
+ *                        loop to destroy the rest. Returns false if
+ *                        nothing was freed. Called when memory runs
+ *                        short, from any context kmalloc can be
+ *                        called from, so it can't run destructors.
+ *
+ *    kmem_cache_reap_idle - destroy and free one retained object that
+ *                        kmem_cache_reap left for later. Returns false
+ *                        if there was nothing to do. Called from the
+ *                        idle loop; does not sleep.
+ *
+ *    kmem_cache_printstats - print retention and hit counts (used by
+ *                        the "kh" menu command).
+ */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+bool kmem_cache_reap(void);
+bool kmem_cache_reap_idle(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KPROF_H_
+#define _KPROF_H_
+
+/*
+ * kmalloc allocation-site profiler, compiled in with "options kprof".
+ *
+ * Every kmalloc records the address it was called from and the size
+ * asked for, and every kfree takes them off again, so at any time we
+ * can say which call sites hold how much of the kernel heap. Sites
+ * are return addresses; look them up with os161-addr2line. Memory
+ * allocated through helpers (kstrdup, arrays, object caches) is
+ * charged to the helper.
+ *
+ * The tables are fixed-size. Allocations from sites beyond the first
+ * KPROF_NSITES are lumped together. The live blocks are spread over a
+ * few separately locked stripes by address, each with its share of
+ * KPROF_NBLOCKS; blocks that find their stripe full go uncounted (the
+ * printout says how many). Peaks are added up over the stripes, so
+ * they may come out a little high.
+ */
+
+#include <machine/vm.h>
+
+#define KPROF_NSITES	256	/* call sites tracked; power of 2 */
+#define KPROF_NBLOCKS	4096	/* live blocks tracked */
+
+/*
+ * Functions:
+ *
+ *    kprof_alloc - record that SITE kmalloc'd PTR, of SZ bytes.
+ *
+ *    kprof_free  - record that PTR was freed.
+ *
+ *    kprof_print - print the N sites with the most bytes live, with
+ *                  their allocation counts and peaks.
+ */
+void kprof_alloc(void *ptr, size_t sz, vaddr_t site);
+void kprof_free(void *ptr);
+void kprof_print(unsigned n);
+
+
+#endif /* _KPROF_H_ */
@@ -126,6 +126,7 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+bool kheap_reclaim(void);
 
 /*
  * C string functions. 
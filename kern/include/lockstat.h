@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Per-lock contention counters, compiled in with "options lockstat".
+ *
+ * Counters are kept per name rather than per lock, so that locks
+ * which come and go (one per process, say) add up to something
+ * useful and don't take their numbers with them when destroyed.
+ * Sleep locks are counted under their lk_name, and so are the
+ * spinlocks inside each one (its own and its wait channel's); likewise
+ * semaphores and rwlocks. Other spinlocks are counted under the name given
+ * by spinlock_setname or SPINLOCK_NAMED_INITIALIZER, or failing that
+ * under the source file that first acquires them. Spinlocks and sleep
+ * locks with the same name are kept apart.
+ *
+ * For a spinlock, a contended acquisition is one that didn't get the
+ * next ticket straight away, and spins are iterations of the backoff
+ * loop. For a sleep lock, it is one that found the lock held; spins
+ * are iterations of the adaptive spin, spin wins are contended
+ * acquisitions that got the lock without sleeping, sleeps are trips
+ * through the wait channel, and wait ticks are hardclocks between
+ * asking for the lock and getting it. Spinlocks wait with interrupts
+ * off, so there are no wait ticks or sleeps to count for them.
+ *
+ * Locks with the same name share counters without sharing a lock, so
+ * the counters are kept per cpu and added up when printed; each cpu
+ * only ever adds to its own. Each cpu's counters also have a one-word
+ * guard, so that the printout never sees a 64-bit count half-written.
+ * Cpus past the first LOCKSTAT_MAXCPUS aren't counted. The table is
+ * fixed-size; names beyond the first LOCKSTAT_NNAMES share a slot
+ * that isn't printed (the printout says how many there were).
+ */
+
+#define LOCKSTAT_NNAMES		256	/* names tracked; power of 2 */
+#define LOCKSTAT_NAMELEN	24	/* longer names are truncated */
+#define LOCKSTAT_MAXCPUS	8	/* any further cpus aren't counted */
+
+struct lockstat {
+	char lst_name[LOCKSTAT_NAMELEN];	/* empty if slot unused */
+	bool lst_sleeplock;		/* struct lock, not spinlock */
+};
+
+struct lockstat_counts {
+	unsigned lc_acquires;		/* acquisitions */
+	unsigned lc_contended;		/* ...that had to wait */
+	unsigned lc_spinwins;		/* ...and didn't have to sleep */
+	unsigned lc_sleeps;		/* times a waiter slept */
+	uint64_t lc_spins;		/* busy-wait loop iterations */
+	uint64_t lc_waitticks;		/* hardclocks spent waiting */
+};
+
+/*
+ * Functions:
+ *
+ *    lockstat_get   - return the counters for locks called NAME, of
+ *                     the kind given by SLEEPLOCK. If the table is
+ *                     full, returns the shared slot for the rest.
+ *
+ *    lockstat_add   - add LC, one acquisition's worth, to the current
+ *                     cpu's counters for LST. Call with a spinlock
+ *                     held (the one acquired, or the sleep lock's
+ *                     lk_lock), so we stay on this cpu.
+ *
+ *    lockstat_print - print the N names with the most contended
+ *                     acquisitions.
+ *
+ *    lockstat_reset - zero all the counters, e.g. between benchmark
+ *                     runs. Names stay where they are.
+ */
+struct lockstat *lockstat_get(const char *name, bool sleeplock);
+void lockstat_add(struct lockstat *lst, const struct lockstat_counts *lc);
+void lockstat_print(unsigned n);
+void lockstat_reset(void);
+
+
+#endif /* _LOCKSTAT_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page tables.
+ *
+ * A virtual address is split 10/10/12: the top ten bits index the
+ * directory, the next ten index a second-level table, and the rest
+ * is the offset within the page. Both levels are exactly one page,
+ * and second-level tables are only allocated once something in the
+ * 4M of address space they cover is touched.
+ *
+ * A page table entry holds the physical frame of a resident page
+ * together with flag bits. A page that has been evicted instead holds
+ * its swap slot in the frame bits, with PTE_SWAPPED set. A zero entry
+ * means the page has never been touched (or was clean when evicted)
+ * and gets filled in on its next fault.
+ */
+
+#include <machine/vm.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	0xfffff000	/* physical frame, if PTE_VALID */
+#define PTE_VALID	0x00000001	/* page is resident at PTE_FRAME */
+#define PTE_SWAPPED	0x00000002	/* page is in swap, not resident */
+#define PTE_BUSY	0x00000004	/* page is being evicted */
+
+#define PTE_TO_SWAPSLOT(pte)	((pte) >> 12)
+#define SWAPSLOT_TO_PTE(slot)	((pte_t)(slot) << 12)
+
+#define PT_L1_INDEX(va)	(((va) >> 22) & 0x3ff)
+#define PT_L2_INDEX(va)	(((va) >> 12) & 0x3ff)
+#define PT_NENTRIES	1024
+
+struct pagetable {
+	pte_t *pt_dir[PT_NENTRIES];	/* second-level tables, or NULL */
+};
+
+/*
+ * Functions:
+ *
+ *    pt_create  - allocate an empty page table. Returns NULL if out of
+ *                 memory.
+ *
+ *    pt_destroy - free the page table structures. Does not touch the
+ *                 pages the entries refer to; that's up to the caller.
+ *
+ *    pt_lookup  - return a pointer to the entry for VADDR. If the
+ *                 second-level table does not exist yet, it is created
+ *                 when CREATE is true; otherwise (or if out of memory)
+ *                 NULL is returned.
+ *
+ *    pt_walk    - call FUNC on every nonzero entry, in address order.
+ *                 If FUNC returns nonzero the walk stops and that value
+ *                 is returned.
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_walk(struct pagetable *pt,
+	    int (*func)(vaddr_t vaddr, pte_t *pte, void *data), void *data);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -73,6 +73,7 @@ struct proc {
 	struct cv *p_exited_cv;
 
 	struct array *p_children; /* dynamic array to keep track of process's children */
+	struct rwlock *p_children_lock; /* readers look up, fork/exit change it */
 	struct proc *p_parent;
 	#endif
 
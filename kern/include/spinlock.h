@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -50,19 +51,44 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * This is a ticket lock: a cpu that wants the lock takes the next
+ * ticket from lk_next, and has it when lk_serving comes round to
+ * that number. So cpus get the lock in the order they asked for it,
+ * and releasing it is a plain store rather than a fight over the
+ * lock word. The lock is free when the two are equal (so all zeros
+ * is a free lock).
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket that has the lock. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* Counters, once looked up. */
+	const char *lk_statname;	/* Name to count under, or NULL. */
+#endif
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or
+ * global. The second also names the lock for the contention counters,
+ * like spinlock_setname; NAME must stay around.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  NULL, NULL }
+#define SPINLOCK_NAMED_INITIALIZER(name) \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  NULL, name }
+#else
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_NAMED_INITIALIZER(name) SPINLOCK_INITIALIZER
+#endif
 
 /*
  * Spinlock functions.
@@ -74,15 +100,31 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Count the lock's contention under NAME (see lockstat.h).
+ *		Does nothing unless the kernel has "options lockstat".
+ *		NAME need not stay around. A lock that isn't named is
+ *		counted under the source file that first acquires it.
  */
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
+#if OPT_LOCKSTAT
+#define spinlock_acquire(lk) spinlock_acquire_from(lk, __FILE__)
+void spinlock_acquire_from(struct spinlock *lk, const char *file);
+#else
 void spinlock_acquire(struct spinlock *lk);
+#endif
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKSTAT
+void spinlock_setname(struct spinlock *lk, const char *name);
+#else
+#define spinlock_setname(lk, name) ((void)(lk), (void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are written to a raw disk device, one page
+ * per slot. Slots are handed out from a bitmap. Swap is optional: if
+ * the device can't be opened the system runs without it, and only
+ * clean pages can be evicted.
+ */
+
+#include <machine/vm.h>
+
+/* Device used for swap. */
+#define SWAP_DEVICE	"lhd0raw:"
+
+/* Call once from vm_bootstrap(), after devices have been probed. */
+void swap_bootstrap(void);
+
+/*
+ * Functions:
+ *
+ *    swap_alloc - reserve a free slot and return it through SLOT.
+ *                 Returns ENOSPC if swap is full or not configured.
+ *                 Does not sleep.
+ *
+ *    swap_free  - release a slot. Does not sleep.
+ *
+ *    swap_in    - read the page in SLOT into the frame at PADDR.
+ *
+ *    swap_out   - write the frame at PADDR to SLOT.
+ */
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_in(unsigned slot, paddr_t paddr);
+int swap_out(paddr_t paddr, unsigned slot);
+
+
+#endif /* _SWAP_H_ */
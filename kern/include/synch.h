@@ -76,9 +76,13 @@ struct lock {
         char *lk_name;
         // add what you need here
         // (don't forget to mark things volatile as needed)
-        volatile struct thread *lk_owner;
+        /* the pointer is volatile too: lock_acquire spins on it */
+        volatile struct thread *volatile lk_owner;
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
+#if OPT_LOCKSTAT
+        struct lockstat *lk_stat;       /* counters for lk_name */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -94,6 +98,12 @@ void lock_acquire(struct lock *);
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
+ *
+ * lock_acquire is adaptive: if the holder is running on another cpu
+ * it spins for a while, since the lock is likely to come free before
+ * a context switch could be done, and only sleeps if it doesn't or
+ * the holder stops running. With "options lockstat" how often each of
+ * those happens is counted under the lock's name (see lockstat.h).
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
@@ -142,4 +152,66 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't keep writers out.
+ * To keep writers from starving readers in turn, after
+ * rw_writerburst writers in a row have gone ahead of waiting
+ * readers, the readers waiting at that point are let in before the
+ * next writer. A burst of 0 means strict writer preference.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct wchan *rw_readwchan;	/* readers wait here */
+	struct wchan *rw_writewchan;	/* writers wait here */
+	struct spinlock rw_lock;	/* protects the rest */
+	volatile struct thread *rw_writer; /* holder for writing, or NULL */
+	volatile unsigned rw_readers;	/* number holding it for reading */
+	unsigned rw_readwait;		/* readers waiting */
+	unsigned rw_writewait;		/* writers waiting */
+	unsigned rw_readpass;		/* readers let in past writers */
+	unsigned rw_writerun;		/* writers in a row past readers */
+	unsigned rw_writerburst;	/* limit on rw_writerun */
+};
+
+/* Default rw_writerburst. */
+#define RWLOCK_WRITERBURST	4
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock for reading, along with any
+ *                            other readers.
+ *    rwlock_release_read   - Give up a read hold.
+ *    rwlock_acquire_write  - Get the lock for writing, alone.
+ *    rwlock_release_write  - Give up a write hold. Only the writer
+ *                            may do this.
+ *    rwlock_downgrade      - Turn the current thread's write hold into
+ *                            a read hold, without letting any other
+ *                            writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                            the lock for writing.
+ *    rwlock_setfairness    - Set rw_writerburst (see above).
+ *
+ * Read holds are not tracked per thread, so a thread that holds the
+ * lock for reading must not try to get it again, for reading or
+ * writing; with a writer waiting that deadlocks.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+void rwlock_setfairness(struct rwlock *, unsigned writerburst);
+
+
 #endif /* _SYNCH_H_ */
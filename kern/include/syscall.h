@@ -31,6 +31,7 @@
 #define _SYSCALL_H_
 
 #include <opt-A2.h>
+#include <opt-A3.h>
 
 
 struct trapframe; /* from <machine/trapframe.h> */
@@ -67,6 +68,11 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 #if OPT_A2
 int sys_fork(struct trapframe *tf, pid_t *retval);
 #endif
+#if OPT_A3
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+#endif
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
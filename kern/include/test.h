@@ -60,6 +60,8 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int spinlockbench(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Text page cache.
+ *
+ * Read-only pages loaded from executables are kept here so that every
+ * process running the same program maps the same physical frames
+ * instead of reading and holding its own copy.
+ *
+ * A page is identified by the vnode it comes from, the file offset
+ * that corresponds to the start of the page, and the byte range
+ * [START, END) within the page that comes from the file (the rest is
+ * zero). The offset may be negative if the file data starts partway
+ * into the page.
+ *
+ * Frames are reference counted in the coremap. The cache holds one
+ * reference to each frame (and one to each vnode) itself; every
+ * process that maps the page holds another. A frame that nobody but
+ * the cache is using can be given back with textcache_reclaim.
+ */
+
+#include <machine/vm.h>
+
+struct vnode;
+
+/*
+ * Functions:
+ *
+ *    textcache_lookup  - return the frame holding the given page, with
+ *                        a new reference for the caller, or 0 if it
+ *                        isn't cached.
+ *
+ *    textcache_insert  - offer the frame PADDR, which holds the given
+ *                        page and which the caller has a reference to.
+ *                        Returns the frame the caller should use: if
+ *                        someone else cached the page first, that's
+ *                        theirs (with a new reference) and the caller
+ *                        should drop PADDR; otherwise it's PADDR.
+ *
+ *    textcache_reclaim - free one cached frame that no process is
+ *                        using. Returns false if there isn't one. May
+ *                        sleep.
+ */
+paddr_t textcache_lookup(struct vnode *v, off_t offset,
+			 unsigned start, unsigned end);
+paddr_t textcache_insert(struct vnode *v, off_t offset,
+			 unsigned start, unsigned end, paddr_t paddr);
+bool textcache_reclaim(void);
+
+
+#endif /* _TEXTCACHE_H_ */
@@ -101,6 +101,22 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields. Protected by the runqueue lock of t_cpu
+	 * while the thread is running or ready; a sleeping thread's
+	 * belong to whoever wakes it.
+	 *
+	 * t_quantum counts down the hardclocks left in the thread's
+	 * time slice at its current priority; t_readyclock is the
+	 * c_hardclocks value of the cpu whose run queue it last went
+	 * on, for aging, and t_ranclock that of the cpu it last ran
+	 * on when it stopped, for stealing.
+	 */
+	unsigned t_priority;		/* 0 .. SCHED_NPRIO-1, 0 is highest */
+	unsigned t_quantum;		/* Hardclocks left in time slice */
+	unsigned t_readyclock;		/* When it last became ready */
+	unsigned t_ranclock;		/* When it last stopped running */
+
 	/*
 	 * Public fields
 	 */
@@ -124,6 +140,9 @@ void thread_bootstrap(void);
 /* Call late in system startup to get secondary CPUs running. */
 void thread_start_cpus(void);
 
+/* Return the number of CPUs. */
+unsigned thread_numcpus(void);
+
 /* Call during panic to stop other threads in their tracks */
 void thread_panic(void);
 
@@ -158,15 +177,16 @@ void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge a hardclock to the current thread, and yield if its time
+ * slice is over or a higher-priority thread is waiting. Called from
+ * the timer interrupt.
  */
-void schedule(void);
+void thread_timeslice(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Reshuffle the run queue. Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+void schedule(void);
 
 
 #endif /* _THREAD_H_ */
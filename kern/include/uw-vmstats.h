@@ -36,7 +36,15 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_TLB_SHOOTDOWN         (10)
+#define VMSTAT_TLB_SHOOTDOWN_IPI     (11)
+#define VMSTAT_TLB_SHOOTDOWN_ALL     (12)
+#define VMSTAT_TLB_SHOOTDOWN_USEC    (13)
+#define VMSTAT_FAULTAROUND_PRELOAD   (14)
+#define VMSTAT_FAULTAROUND_WRITEABLE (15)
+#define VMSTAT_ZEROPOOL_HIT          (16)
+#define VMSTAT_ZEROPOOL_MISS         (17)
+#define VMSTAT_COUNT                 (18)
 
 /* ----------------------------------------------------------------------- */
 
@@ -52,6 +60,9 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add AMOUNT to the specified count (e.g., a time) */
+void vmstats_add(unsigned int index, unsigned int amount);  /* uses locking */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
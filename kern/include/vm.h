@@ -51,6 +51,12 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Resident neighbours mapped on each TLB miss, in pages on each side */
+extern unsigned vm_faultaround;
+
+/* Set vm_faultaround; EINVAL if it's negative or more than half the TLB */
+int vm_setfaultaround(int pages);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+/*
+ * Pool of pre-zeroed page frames.
+ *
+ * Zero-fill page faults (fresh stack, heap and BSS pages, anonymous
+ * mappings) need a frame full of zeros. Rather than clearing one on
+ * the fault path every time, idle CPUs keep a small pool of frames
+ * that are already clear, and faults take from it first.
+ *
+ * The pool has a low and a high watermark. Once it drops below the low
+ * one, idle CPUs zero frames into it, one at a time, until it reaches
+ * the high one. Only frames that are free anyway are used: refilling
+ * never pages anything out, and when memory runs short the whole pool
+ * is given back.
+ */
+
+#include <machine/vm.h>
+
+/* Most frames the pool can hold, and the default watermarks. */
+#define ZEROPOOL_MAX		128
+#define ZEROPOOL_LOWAT_DEFAULT	8
+#define ZEROPOOL_HIWAT_DEFAULT	32
+
+/*
+ * Functions:
+ *
+ *    zeropool_get      - take a zeroed frame from the pool, with one
+ *                        reference, or return 0 if it's empty. Counts
+ *                        a pool hit or miss in vmstats.
+ *
+ *    zeropool_refill   - zero one more frame into the pool, if it's
+ *                        being refilled. Returns false if there was
+ *                        nothing to do. Called from the idle loop;
+ *                        does not sleep.
+ *
+ *    zeropool_reclaim  - give every frame in the pool back to the
+ *                        coremap. Returns false if it was empty.
+ *
+ *    zeropool_setwat   - set the watermarks. Returns EINVAL unless
+ *                        LOWAT <= HIWAT <= ZEROPOOL_MAX.
+ *
+ *    zeropool_printstats - print the pool size and watermarks.
+ */
+paddr_t zeropool_get(void);
+bool zeropool_refill(void);
+bool zeropool_reclaim(void);
+int zeropool_setwat(unsigned lowat, unsigned hiwat);
+void zeropool_printstats(void);
+
+
+#endif /* _ZEROPOOL_H_ */
@@ -43,12 +43,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kmem_cache.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -76,6 +78,69 @@ struct semaphore *no_proc_sem;
 
 
 
+/*
+ * Cache of proc structures. The constructed state has the process's
+ * locks and (empty) arrays already created, so that fork doesn't need
+ * to make them from scratch each time.
+ */
+static int proc_ctor(void *obj);
+static void proc_dtor(void *obj);
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor, 16);
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	#if OPT_A2
+	proc->p_mutex = lock_create("p_mutex");
+	proc->p_exited_cv = cv_create("p_exited_cv");
+	proc->p_children = array_create();
+	proc->p_children_lock = rwlock_create("p_children");
+	if (proc->p_mutex == NULL || proc->p_exited_cv == NULL ||
+	    proc->p_children == NULL || proc->p_children_lock == NULL) {
+		if (proc->p_children_lock != NULL) {
+			rwlock_destroy(proc->p_children_lock);
+		}
+		if (proc->p_children != NULL) {
+			array_destroy(proc->p_children);
+		}
+		if (proc->p_exited_cv != NULL) {
+			cv_destroy(proc->p_exited_cv);
+		}
+		if (proc->p_mutex != NULL) {
+			lock_destroy(proc->p_mutex);
+		}
+		return ENOMEM;
+	}
+	#endif
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	#if OPT_A2
+	rwlock_destroy(proc->p_children_lock);
+	array_destroy(proc->p_children);
+	cv_destroy(proc->p_exited_cv);
+	lock_destroy(proc->p_mutex);
+	#endif
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -85,18 +150,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	/* p_threads and p_lock are set up by proc_ctor. */
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -109,25 +173,7 @@ proc_create(const char *name)
 #endif // UW
 
 	#if OPT_A2
-	proc->p_mutex = lock_create("p_mutex");
-	if (proc->p_mutex == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->p_exited_cv = cv_create("p_exited_cv");
-	if(proc->p_exited_cv == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->p_children = array_create();
-	array_init(proc->p_children);
-	if (proc->p_children == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
+	/* So are p_mutex, p_exited_cv, p_children and p_children_lock. */
 	proc->p_parent = NULL;
 	proc->p_exited = false;
 	#endif
@@ -166,23 +212,19 @@ proc_destroy(struct proc *proc)
 	}
 
 	#if OPT_A2
-	if (proc->p_mutex != NULL) 
-	{
-		lock_destroy(proc->p_mutex);
-	}
-
-	if (proc->p_exited_cv != NULL) 
+	/* The locks and p_exited_cv stay for the next user; see proc_ctor. */
 	{
-		cv_destroy(proc->p_exited_cv);
-	}
+		struct proc *childproc;
 
-	if (proc->p_children != NULL) 
-	{
-		unsigned int numchildren = array_num(proc->p_children);
-		unsigned int i;
-		for (i = 0; i < numchildren; i++) {
-			struct proc *childproc = (struct proc *)array_get(proc->p_children, 0);
+		while (1) {
+			rwlock_acquire_write(proc->p_children_lock);
+			if (array_num(proc->p_children) == 0) {
+				rwlock_release_write(proc->p_children_lock);
+				break;
+			}
+			childproc = (struct proc *)array_get(proc->p_children, 0);
 			array_remove(proc->p_children, 0);
+			rwlock_release_write(proc->p_children_lock);
 			// if (childproc->p_exited == true) {
 			// 	childproc->p_parent = NULL;
 			// 	proc_destroy(childproc);
@@ -199,7 +241,6 @@ proc_destroy(struct proc *proc)
 			childproc->p_parent = NULL;
 			proc_destroy(childproc);
 		}
-		array_destroy(proc->p_children);
 	}
 	#endif
 
@@ -230,11 +271,11 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	/* Back to the state proc_ctor left it in. */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -49,7 +49,9 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
 
 
 /*
@@ -153,6 +155,10 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	splhigh();
 }
 
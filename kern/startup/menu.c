@@ -42,9 +42,16 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <zeropool.h>
+#include <kprof.h>
+#include <lockstat.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+#include "opt-kprof.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -399,6 +406,95 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+#if OPT_A3
+/*
+ * Command for showing or setting the fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		result = vm_setfaultaround(atoi(args[1]));
+		if (result) {
+			kprintf("fa: need 0 <= pages <= half the TLB\n");
+			return result;
+		}
+	}
+	kprintf("Fault-around window: %u pages each side\n", vm_faultaround);
+	return 0;
+}
+
+/*
+ * Command for showing or setting the zero pool watermarks.
+ */
+static
+int
+cmd_zeropool(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 1 && nargs != 3) {
+		kprintf("Usage: zp [low high]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		result = zeropool_setwat(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("zp: need low <= high <= %d\n", ZEROPOOL_MAX);
+			return result;
+		}
+	}
+	zeropool_printstats();
+	return 0;
+}
+#endif
+
+#if OPT_KPROF
+/*
+ * Command for printing the top kmalloc call sites.
+ */
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: kprof [count]\n");
+		return EINVAL;
+	}
+	kprof_print(nargs == 2 ? (unsigned)atoi(args[1]) : 10);
+	return 0;
+}
+#endif
+
+#if OPT_LOCKSTAT
+/*
+ * Command for printing the most contended locks, or for zeroing the
+ * counters before a run.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: lockstat [count | reset]\n");
+		return EINVAL;
+	}
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+		return 0;
+	}
+	lockstat_print(nargs == 2 ? (unsigned)atoi(args[1]) : 10);
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -453,6 +549,10 @@ static const char *opsmenu[] = {
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	"[dth]     Enable DB_THREADS messages  ",
+#if OPT_A3
+	"[fa]      Fault-around window       ",
+	"[zp]      Zero pool watermarks      ",
+#endif
 	NULL
 };
 
@@ -481,6 +581,8 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test          (1)     ",
+	"[sy5] Spinlock throughput           ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -521,6 +623,12 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_KPROF
+	"[kprof] Top kmalloc call sites      ",
+#endif
+#if OPT_LOCKSTAT
+	"[lockstat] Most contended locks     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -566,6 +674,10 @@ static struct {
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
 	{ "dth", 	cmd_dth },
+#if OPT_A3
+	{ "fa",		cmd_faultaround },
+	{ "zp",		cmd_zeropool },
+#endif
 
 #if OPT_SYNCHPROBS
 	/* in-kernel synchronization problem(s) */
@@ -578,6 +690,12 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_KPROF
+	{ "kprof",	cmd_kprof },
+#endif
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -595,6 +713,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	spinlockbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
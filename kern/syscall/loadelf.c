@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -73,7 +74,11 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * With OPT_A3 segments are not loaded here at all; the VM system reads
+ * each page in from the file when it is first touched.
  */
+#if !OPT_A3
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +149,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* !OPT_A3 */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -159,6 +165,9 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	struct iovec iov;
 	struct uio ku;
 	struct addrspace *as;
+#if OPT_A3
+	struct stat st;
+#endif
 
 	as = curproc_getas();
 
@@ -202,6 +211,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+#if OPT_A3
+	/* Needed to check segments against the file size. */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+#endif
+
 	/*
 	 * Go through the list of segments and set up the address space.
 	 *
@@ -243,11 +260,30 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		if ((off_t)ph.p_offset + ph.p_filesz > st.st_size) {
+			/* Would only show up as a short read at fault time. */
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		result = as_define_segment(as,
+					   ph.p_vaddr, ph.p_memsz,
+					   v, ph.p_offset, ph.p_filesz,
+					   ph.p_flags & PF_R,
+					   ph.p_flags & PF_W,
+					   ph.p_flags & PF_X);
+#else
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -258,6 +294,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if !OPT_A3
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +332,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif
 
 	result = as_complete_load(as);
 	if (result) {
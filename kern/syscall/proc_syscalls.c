@@ -40,11 +40,8 @@ int sys_fork(struct trapframe *tf,
   /* create the child's address and copy the parent's address space to it */
   KASSERT(curproc->p_addrspace != NULL);
 
-  struct addrspace *childas = as_create();
-
-  if (childas == NULL) {
-    return ENOMEM;
-  }
+  /* as_copy() creates the child's address space itself */
+  struct addrspace *childas;
 
   int as_copy_err;
   as_copy_err = as_copy(curproc_getas(), &childas);
@@ -62,12 +59,12 @@ int sys_fork(struct trapframe *tf,
 
   /* Add the child to the parent's list of children*/
   KASSERT(curproc->p_children != NULL);
-  KASSERT(curproc->p_mutex != NULL);
-  lock_acquire(curproc->p_mutex);
+  KASSERT(curproc->p_children_lock != NULL);
+  rwlock_acquire_write(curproc->p_children_lock);
   array_add(curproc->p_children,
             (void *)childproc,
             NULL);
-  lock_release(curproc->p_mutex);
+  rwlock_release_write(curproc->p_children_lock);
 
   /* Need to give the child proc the new address space. */
   /* Look at curproc_setas(). */
@@ -378,6 +375,7 @@ sys_waitpid(pid_t pid,
 
   /* Locate the child by its pid. */
   struct proc *childproc = NULL;
+  rwlock_acquire_read(curproc->p_children_lock);
   unsigned int numchildren = array_num(curproc->p_children);
   unsigned int i;
   for (i = 0; i < numchildren; i++) {
@@ -386,6 +384,7 @@ sys_waitpid(pid_t pid,
       break;
     }
   }
+  rwlock_release_read(curproc->p_children_lock);
 
   /* If the child is not found, produce error. */
   if (childproc == NULL) {
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <opt-A3.h>
+
+#if OPT_A3
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return the old
+ * end. The heap itself is managed by as_sbrk.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap: map LEN bytes of anonymous memory somewhere of our choosing;
+ * ADDR is only a hint and is ignored. There is no file table to look
+ * descriptors up in, so there are no file mappings, and the
+ * descriptor and offset (which would be on the user stack) are never
+ * looked at.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	(void)addr;
+
+	if ((flags & MAP_ANON) == 0) {
+		return EBADF;
+	}
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_mmap(as, len, prot, flags, retval);
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+#endif /* OPT_A3 */
@@ -32,7 +32,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
@@ -41,6 +43,7 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      200
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -347,3 +350,360 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test.
+ *
+ * One thread in four is a writer; the rest read. Writers store a
+ * consistent set of values, yielding halfway through to give anyone
+ * who wrongly got in a chance to see the half-done state; readers
+ * check the values are consistent and stay put. Every other writer
+ * downgrades to a read hold and checks nobody else wrote in
+ * between. The number of threads in each role is tracked under a
+ * spinlock, so overlap between a writer and anyone else is caught
+ * directly, and so is whether readers ever actually ran together.
+ */
+
+static struct rwlock *testrw;
+static struct spinlock rwtest_lock = SPINLOCK_INITIALIZER;
+static unsigned rwtest_readers, rwtest_writers;
+static unsigned rwtest_maxreaders, rwtest_errors;
+
+static
+void
+rwtest_enter(bool writer)
+{
+	spinlock_acquire(&rwtest_lock);
+	if (writer) {
+		if (rwtest_readers > 0 || rwtest_writers > 0) {
+			rwtest_errors++;
+		}
+		rwtest_writers++;
+	}
+	else {
+		if (rwtest_writers > 0) {
+			rwtest_errors++;
+		}
+		rwtest_readers++;
+		if (rwtest_readers > rwtest_maxreaders) {
+			rwtest_maxreaders = rwtest_readers;
+		}
+	}
+	spinlock_release(&rwtest_lock);
+}
+
+static
+void
+rwtest_leave(bool writer)
+{
+	spinlock_acquire(&rwtest_lock);
+	if (writer) {
+		rwtest_writers--;
+	}
+	else {
+		rwtest_readers--;
+	}
+	spinlock_release(&rwtest_lock);
+}
+
+static
+void
+rwtest_error(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: Mismatch on %s\n", num, msg);
+	spinlock_acquire(&rwtest_lock);
+	rwtest_errors++;
+	spinlock_release(&rwtest_lock);
+}
+
+static
+void
+rwtest_check(unsigned long num)
+{
+	unsigned long v1, v2, v3;
+
+	v1 = testval1;
+	v2 = testval2;
+	v3 = testval3;
+	if (v2 != v1*v1 || v3 != v1%3) {
+		rwtest_error(num, "testval1/2/3");
+	}
+	thread_yield();
+	if (testval1 != v1 || testval2 != v2 || testval3 != v3) {
+		rwtest_error(num, "values changed under a read hold");
+	}
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	bool writer;
+	(void)junk;
+
+	writer = (num % 4 == 0);
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (!writer) {
+			rwlock_acquire_read(testrw);
+			rwtest_enter(false);
+			rwtest_check(num);
+			rwtest_leave(false);
+			rwlock_release_read(testrw);
+			continue;
+		}
+
+		rwlock_acquire_write(testrw);
+		rwtest_enter(true);
+		testval1 = num + i;
+		thread_yield();
+		testval2 = (num + i) * (num + i);
+		testval3 = (num + i) % 3;
+		rwtest_leave(true);
+
+		if (i % 2 == 0) {
+			rwlock_release_write(testrw);
+			continue;
+		}
+
+		rwlock_downgrade(testrw);
+		rwtest_enter(false);
+		if (testval1 != num + i) {
+			rwtest_error(num, "write after downgrade");
+		}
+		rwtest_check(num);
+		rwtest_leave(false);
+		rwlock_release_read(testrw);
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = testval3 = 0;
+	rwtest_readers = rwtest_writers = 0;
+	rwtest_maxreaders = rwtest_errors = 0;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread,
+				     NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Most readers at once: %u\n", rwtest_maxreaders);
+	if (rwtest_errors > 0) {
+		kprintf("%u errors\n", rwtest_errors);
+		kprintf("Test failed\n");
+	}
+	kprintf("RW lock test done.\n");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Spinlock throughput.
+ *
+ * For each number of threads from 1 up to the number of cpus (or
+ * the count given), that many threads each acquire and release one
+ * spinlock SPINBENCH_LOOPS times, with a short critical section,
+ * and we report acquires per millisecond. The threads wait for
+ * each other before starting so that they actually overlap; with
+ * work stealing they spread out over the cpus by then.
+ *
+ * Each count is run twice: once with a real spinlock, and once with
+ * the plain test-and-test-and-set loop spinlocks used to be, as a
+ * baseline to compare the ticket lock against.
+ */
+
+#define SPINBENCH_LOOPS	20000
+
+static struct spinlock spinbench_lock = SPINLOCK_INITIALIZER;
+static volatile spinlock_data_t spinbench_taslock;
+static volatile unsigned spinbench_ready;
+static volatile bool spinbench_go;
+static volatile unsigned long spinbench_count;
+
+/*
+ * The baseline lock. Like spinlock_acquire, it raises the spl first;
+ * the caller passes the old one back to spinbench_tasrelease.
+ */
+static
+int
+spinbench_tasacquire(void)
+{
+	int spl;
+
+	spl = splhigh();
+	while (1) {
+		/* Spin reading, so as not to hammer the bus with LL/SC. */
+		if (spinlock_data_get(&spinbench_taslock) != 0) {
+			continue;
+		}
+		if (spinlock_data_testandset(&spinbench_taslock) == 0) {
+			break;
+		}
+	}
+	return spl;
+}
+
+static
+void
+spinbench_tasrelease(int spl)
+{
+	spinlock_data_set(&spinbench_taslock, 0);
+	splx(spl);
+}
+
+static
+void
+spinbenchthread(void *junk, unsigned long tas)
+{
+	int i, spl;
+
+	(void)junk;
+
+	spinlock_acquire(&spinbench_lock);
+	spinbench_ready++;
+	spinlock_release(&spinbench_lock);
+
+	while (!spinbench_go) {
+		thread_yield();
+	}
+
+	for (i=0; i<SPINBENCH_LOOPS; i++) {
+		if (tas) {
+			spl = spinbench_tasacquire();
+			spinbench_count++;
+			spinbench_tasrelease(spl);
+		}
+		else {
+			spinlock_acquire(&spinbench_lock);
+			spinbench_count++;
+			spinlock_release(&spinbench_lock);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+/*
+ * Run N threads on the spinlock, or on the baseline lock if TAS, and
+ * return how long they took in microseconds.
+ */
+static
+uint64_t
+spinbench_run(unsigned n, bool tas)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t usecs;
+	unsigned i;
+	int result;
+
+	spinbench_ready = 0;
+	spinbench_go = false;
+	spinbench_count = 0;
+
+	for (i=0; i<n; i++) {
+		result = thread_fork("spinbench", NULL,
+				     spinbenchthread, NULL, tas);
+		if (result) {
+			panic("spinlockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	while (spinbench_ready < n) {
+		thread_yield();
+	}
+
+	gettime(&secs1, &nsecs1);
+	spinbench_go = true;
+	for (i=0; i<n; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	if (spinbench_count != (unsigned long)n * SPINBENCH_LOOPS) {
+		kprintf("Lost updates: %lu of %lu\n", spinbench_count,
+			(unsigned long)n * SPINBENCH_LOOPS);
+		kprintf("Test failed\n");
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	return usecs == 0 ? 1 : usecs;
+}
+
+int
+spinlockbench(int nargs, char **args)
+{
+	unsigned n, maxthreads;
+	uint64_t usecs, tasusecs;
+
+	if (nargs > 2) {
+		kprintf("Usage: sy5 [maxthreads]\n");
+		return EINVAL;
+	}
+	maxthreads = nargs == 2 ? (unsigned)atoi(args[1]) : thread_numcpus();
+	if (maxthreads < 1) {
+		maxthreads = 1;
+	}
+
+	inititems();
+	kprintf("Starting spinlock benchmark (%u cpus)...\n",
+		thread_numcpus());
+	kprintf("           ------ ticket -------  ---- test-and-set ---\n");
+	kprintf("threads      usecs  acquires/ms      usecs  acquires/ms\n");
+
+	for (n=1; n<=maxthreads; n++) {
+		usecs = spinbench_run(n, false);
+		tasusecs = spinbench_run(n, true);
+		kprintf("%7u %10llu %12llu %10llu %12llu\n", n,
+			(unsigned long long)usecs,
+			(unsigned long long)n * SPINBENCH_LOOPS * 1000 / usecs,
+			(unsigned long long)tasusecs,
+			(unsigned long long)n * SPINBENCH_LOOPS * 1000 /
+				tasusecs);
+	}
+
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
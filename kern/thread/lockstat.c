@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-lock contention counters. See lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <lockstat.h>
+
+static struct lockstat lockstat_names[LOCKSTAT_NNAMES];
+static struct lockstat lockstat_rest;	/* for the names that didn't fit */
+static unsigned lockstat_dropped;	/* how many of those */
+
+/*
+ * Each cpu's counters, one set per name with lockstat_rest's last.
+ * Only that cpu adds to them, with interrupts off. lsc_busy is taken
+ * with test-and-set around every update, and by whoever is reading or
+ * zeroing them; it's never held while acquiring anything else.
+ */
+struct lockstat_cpu {
+	volatile spinlock_data_t lsc_busy;
+	struct lockstat_counts lsc_counts[LOCKSTAT_NNAMES + 1];
+};
+
+static struct lockstat_cpu lockstat_cpus[LOCKSTAT_MAXCPUS];
+
+/* Sums over cpus, for lockstat_print. Protected by lockstat_lock. */
+static struct lockstat_counts lockstat_totals[LOCKSTAT_NNAMES];
+
+/*
+ * Protects the names and lockstat_totals, not the counters. Counted
+ * in lockstat_rest from the start, so that taking it never has to
+ * look its own name up.
+ */
+static struct spinlock lockstat_lock = {
+	SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL,
+	&lockstat_rest, NULL
+};
+
+/*
+ * Compare NAME, truncated as it would be stored, against a slot.
+ */
+static
+bool
+lockstat_match(const struct lockstat *lst, const char *name, bool sleeplock)
+{
+	unsigned i;
+
+	if (lst->lst_sleeplock != sleeplock) {
+		return false;
+	}
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != '\0'; i++) {
+		if (lst->lst_name[i] != name[i]) {
+			return false;
+		}
+	}
+	return lst->lst_name[i] == '\0';
+}
+
+static
+unsigned
+lockstat_hash(const char *name, bool sleeplock)
+{
+	unsigned h, i;
+
+	h = sleeplock ? 1 : 0;
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != '\0'; i++) {
+		h = h * 33 + (unsigned char)name[i];
+	}
+	return h & (LOCKSTAT_NNAMES - 1);
+}
+
+struct lockstat *
+lockstat_get(const char *name, bool sleeplock)
+{
+	struct lockstat *lst;
+	unsigned h, i, j;
+
+	KASSERT(name != NULL);
+
+	h = lockstat_hash(name, sleeplock);
+
+	spinlock_acquire(&lockstat_lock);
+	for (i=0; i<LOCKSTAT_NNAMES; i++) {
+		lst = &lockstat_names[(h + i) & (LOCKSTAT_NNAMES - 1)];
+		if (lst->lst_name[0] == '\0') {
+			/* Not there; take this slot. */
+			for (j=0; j<LOCKSTAT_NAMELEN-1 && name[j] != '\0'; j++) {
+				lst->lst_name[j] = name[j];
+			}
+			lst->lst_name[j] = '\0';
+			lst->lst_sleeplock = sleeplock;
+			spinlock_release(&lockstat_lock);
+			return lst;
+		}
+		if (lockstat_match(lst, name, sleeplock)) {
+			spinlock_release(&lockstat_lock);
+			return lst;
+		}
+	}
+	lockstat_dropped++;
+	spinlock_release(&lockstat_lock);
+	return &lockstat_rest;
+}
+
+static
+void
+lockstat_cpu_lock(struct lockstat_cpu *lsc)
+{
+	while (spinlock_data_testandset(&lsc->lsc_busy) != 0) {
+		/* nothing; it's only ever held briefly */
+	}
+}
+
+static
+void
+lockstat_cpu_unlock(struct lockstat_cpu *lsc)
+{
+	spinlock_data_set(&lsc->lsc_busy, 0);
+}
+
+void
+lockstat_add(struct lockstat *lst, const struct lockstat_counts *lc)
+{
+	struct lockstat_counts *mine;
+	struct lockstat_cpu *lsc;
+	unsigned n;
+
+	/* Before curcpu exists, only the boot cpu is running. */
+	n = CURCPU_EXISTS() ? curcpu->c_number : 0;
+	if (n >= LOCKSTAT_MAXCPUS) {
+		return;
+	}
+	lsc = &lockstat_cpus[n];
+	mine = &lsc->lsc_counts[lst == &lockstat_rest ?
+				LOCKSTAT_NNAMES : lst - lockstat_names];
+
+	lockstat_cpu_lock(lsc);
+	mine->lc_acquires += lc->lc_acquires;
+	mine->lc_contended += lc->lc_contended;
+	mine->lc_spinwins += lc->lc_spinwins;
+	mine->lc_sleeps += lc->lc_sleeps;
+	mine->lc_spins += lc->lc_spins;
+	mine->lc_waitticks += lc->lc_waitticks;
+	lockstat_cpu_unlock(lsc);
+}
+
+/*
+ * Add up every cpu's counters into lockstat_totals. Call with
+ * lockstat_lock held (which also keeps interrupts off; see
+ * lockstat_reset).
+ */
+static
+void
+lockstat_sum(void)
+{
+	struct lockstat_counts *tot, *lc;
+	struct lockstat_cpu *lsc;
+	unsigned i, j;
+
+	bzero(lockstat_totals, sizeof(lockstat_totals));
+	for (j=0; j<LOCKSTAT_MAXCPUS; j++) {
+		lsc = &lockstat_cpus[j];
+		lockstat_cpu_lock(lsc);
+		for (i=0; i<LOCKSTAT_NNAMES; i++) {
+			tot = &lockstat_totals[i];
+			lc = &lsc->lsc_counts[i];
+			tot->lc_acquires += lc->lc_acquires;
+			tot->lc_contended += lc->lc_contended;
+			tot->lc_spinwins += lc->lc_spinwins;
+			tot->lc_sleeps += lc->lc_sleeps;
+			tot->lc_spins += lc->lc_spins;
+			tot->lc_waitticks += lc->lc_waitticks;
+		}
+		lockstat_cpu_unlock(lsc);
+	}
+}
+
+void
+lockstat_print(unsigned n)
+{
+	struct lockstat_counts *lc;
+	bool shown[LOCKSTAT_NNAMES];
+	unsigned i, j, best;
+
+	for (i=0; i<LOCKSTAT_NNAMES; i++) {
+		shown[i] = false;
+	}
+
+	/*
+	 * Take a snapshot and print from that, so that this doesn't
+	 * hold a spinlock through all the console output. (There's
+	 * only the one snapshot, so two printouts at once would get
+	 * in each other's way; it's a menu command.)
+	 */
+	spinlock_acquire(&lockstat_lock);
+	lockstat_sum();
+	spinlock_release(&lockstat_lock);
+
+	kprintf("Most contended locks");
+	if (lockstat_dropped > 0) {
+		kprintf(" (%u names not tracked)", lockstat_dropped);
+	}
+	kprintf(":\n");
+	kprintf("  %-23s %-5s %9s %9s %4s %11s %8s %8s %9s\n",
+		"name", "kind", "acquires", "contended", "%",
+		"spins", "spinwins", "sleeps", "waitticks");
+
+	for (j=0; j<n; j++) {
+		best = LOCKSTAT_NNAMES;
+		for (i=0; i<LOCKSTAT_NNAMES; i++) {
+			if (shown[i] || lockstat_totals[i].lc_acquires == 0) {
+				continue;
+			}
+			if (best == LOCKSTAT_NNAMES ||
+			    lockstat_totals[i].lc_contended >
+			    lockstat_totals[best].lc_contended) {
+				best = i;
+			}
+		}
+		if (best == LOCKSTAT_NNAMES) {
+			break;
+		}
+		shown[best] = true;
+
+		lc = &lockstat_totals[best];
+		kprintf("  %-23s %-5s %9u %9u %4u %11llu %8u %8u %9llu\n",
+			lockstat_names[best].lst_name,
+			lockstat_names[best].lst_sleeplock ? "sleep" : "spin",
+			lc->lc_acquires, lc->lc_contended,
+			(unsigned)((uint64_t)lc->lc_contended * 100 /
+				   lc->lc_acquires),
+			(unsigned long long)lc->lc_spins, lc->lc_spinwins,
+			lc->lc_sleeps,
+			(unsigned long long)lc->lc_waitticks);
+	}
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat_cpu *lsc;
+	unsigned j;
+
+	/*
+	 * Each acquisition is counted in one go once it's over, so
+	 * it lands wholly before or wholly after the reset. Holding
+	 * lockstat_lock keeps interrupts off, so nothing on this cpu
+	 * can be waiting for its own counters while we have them.
+	 */
+	spinlock_acquire(&lockstat_lock);
+	for (j=0; j<LOCKSTAT_MAXCPUS; j++) {
+		lsc = &lockstat_cpus[j];
+		lockstat_cpu_lock(lsc);
+		bzero(lsc->lsc_counts, sizeof(lsc->lsc_counts));
+		lockstat_cpu_unlock(lsc);
+	}
+	spinlock_release(&lockstat_lock);
+}
@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockstat.h>
 
 /*
  * Spinlocks.
@@ -48,8 +49,13 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_stat = NULL;
+	lk->lk_statname = NULL;
+#endif
 }
 
 /*
@@ -59,20 +65,60 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
 }
 
+/*
+ * Loop iterations to wait, per cpu ahead of us in line, before
+ * looking at the lock again.
+ */
+#define SPINLOCK_BACKOFF	8
+
+#if OPT_LOCKSTAT
+/*
+ * Look up the counters for a lock that hasn't got any yet: under its
+ * initializer's name if it has one, or else under the name of FILE,
+ * the source file acquiring it, without the directories.
+ */
+static
+struct lockstat *
+spinlock_getstat(struct spinlock *lk, const char *file)
+{
+	const char *name;
+
+	name = lk->lk_statname;
+	if (name == NULL) {
+		name = strrchr(file, '/');
+		name = (name == NULL) ? file : name + 1;
+	}
+	return lockstat_get(name, false);
+}
+#endif
+
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket, and wait for it to come up.
  */
+#if OPT_LOCKSTAT
+void
+spinlock_acquire_from(struct spinlock *lk, const char *file)
+#else
 void
 spinlock_acquire(struct spinlock *lk)
+#endif
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket, serving;
+	volatile unsigned i;
+#if OPT_LOCKSTAT
+	struct lockstat *lst;
+	struct lockstat_counts lc;
+	uint64_t spins = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +133,38 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	ticket = spinlock_data_fetchinc(&lk->lk_next);
+
+	/*
+	 * Wait our turn. Everyone waiting reads lk_serving, so don't
+	 * keep at it: back off in proportion to how far back in the
+	 * line we are, which is about how long it will take to get to
+	 * us.
+	 */
+	while ((serving = spinlock_data_get(&lk->lk_serving)) != ticket) {
+#if OPT_LOCKSTAT
+		spins += (ticket - serving) * SPINLOCK_BACKOFF;
+#endif
+		for (i = (ticket - serving) * SPINLOCK_BACKOFF; i > 0; i--) {
+			/* nothing */
 		}
-		break;
 	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKSTAT
+	lst = lk->lk_stat;
+	if (lst == NULL) {
+		lst = lk->lk_stat = spinlock_getstat(lk, file);
+	}
+	lc.lc_acquires = 1;
+	lc.lc_contended = spins > 0 ? 1 : 0;
+	lc.lc_spinwins = 0;
+	lc.lc_sleeps = 0;
+	lc.lc_spins = spins;
+	lc.lc_waitticks = 0;
+	lockstat_add(lst, &lc);
+#endif
 }
 
 /*
@@ -122,10 +179,23 @@ spinlock_release(struct spinlock *lk)
 	}
 
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* Only the holder writes lk_serving, so this needn't be atomic. */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
+#if OPT_LOCKSTAT
+/*
+ * Name the lock for the contention counters.
+ */
+void
+spinlock_setname(struct spinlock *lk, const char *name)
+{
+	lk->lk_stat = lockstat_get(name, false);
+}
+#endif
+
 /*
  * Check if the current cpu holds the lock.
  */ 
@@ -38,7 +38,9 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
+#include <lockstat.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -70,6 +72,7 @@ sem_create(const char *name, int initial_count)
 	}
 
 	spinlock_init(&sem->sem_lock);
+	spinlock_setname(&sem->sem_lock, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -175,6 +178,10 @@ lock_create(const char *name)
 
         lock->lk_owner = NULL;
         spinlock_init(&lock->lk_lock);
+        spinlock_setname(&lock->lk_lock, lock->lk_name);
+#if OPT_LOCKSTAT
+        lock->lk_stat = lockstat_get(lock->lk_name, true);
+#endif
         
         return lock;
 }
@@ -194,9 +201,36 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Adaptive spinning.
+ *
+ * A waiter whose lock is held by a thread running on another cpu
+ * spins, with the lock's spinlock released, for LOCK_SPIN_MINDELAY
+ * loop iterations, then twice that, and so on up to
+ * LOCK_SPIN_MAXDELAY, looking again after each round. After
+ * LOCK_SPIN_ROUNDS rounds, or as soon as the holder isn't running,
+ * it goes to sleep as before. The holder can't go away while it
+ * holds the lock, and lk_lock keeps it from letting go while we look
+ * at it, so it's safe to check its state under lk_lock.
+ *
+ * With "options lockstat", how often each of those happens is
+ * counted under the lock's name.
+ */
+#define LOCK_SPIN_ROUNDS	8
+#define LOCK_SPIN_MINDELAY	16
+#define LOCK_SPIN_MAXDELAY	1024
+
 void
 lock_acquire(struct lock *lock)
 {
+        volatile struct thread *owner;
+        unsigned rounds, delay, i;
+#if OPT_LOCKSTAT
+        struct lockstat_counts lc;
+        unsigned start = 0, sleeps = 0;
+        uint64_t spins = 0;
+#endif
+
         // Write this
         /*
          * May not block in an interrupt handler.
@@ -218,9 +252,39 @@ lock_acquire(struct lock *lock)
         KASSERT(lock != NULL);
         KASSERT(!lock_do_i_hold(lock));
 
+        rounds = 0;
+        delay = LOCK_SPIN_MINDELAY;
+
         spinlock_acquire(&lock->lk_lock);
 
-        while(lock->lk_owner) {
+#if OPT_LOCKSTAT
+        if (CURCPU_EXISTS()) {
+                start = curcpu->c_hardclocks;
+        }
+#endif
+
+        while ((owner = lock->lk_owner) != NULL) {
+                if (rounds < LOCK_SPIN_ROUNDS && owner->t_state == S_RUN &&
+                    owner->t_cpu != curcpu->c_self) {
+                        spinlock_release(&lock->lk_lock);
+                        for (i=0; i<delay && lock->lk_owner == owner; i++) {
+                                /* spin */
+                        }
+#if OPT_LOCKSTAT
+                        spins += i;
+#endif
+                        if (delay < LOCK_SPIN_MAXDELAY) {
+                                delay *= 2;
+                        }
+                        rounds++;
+                        spinlock_acquire(&lock->lk_lock);
+                        continue;
+                }
+
+#if OPT_LOCKSTAT
+                sleeps++;
+#endif
+
                 wchan_lock(lock->lk_wchan);
                 spinlock_release(&lock->lk_lock);
                 wchan_sleep(lock->lk_wchan);
@@ -230,6 +294,25 @@ lock_acquire(struct lock *lock)
 
         lock->lk_owner = curthread;
 
+#if OPT_LOCKSTAT
+        /*
+         * We may have woken up on another cpu, whose hardclock count
+         * is a little different; close is good enough.
+         */
+        if (lock->lk_stat != NULL) {
+                lc.lc_acquires = 1;
+                lc.lc_contended = (rounds > 0 || sleeps > 0) ? 1 : 0;
+                lc.lc_spinwins = (rounds > 0 && sleeps == 0) ? 1 : 0;
+                lc.lc_sleeps = sleeps;
+                lc.lc_spins = spins;
+                lc.lc_waitticks = 0;
+                if (lc.lc_contended && CURCPU_EXISTS()) {
+                        lc.lc_waitticks = curcpu->c_hardclocks - start;
+                }
+                lockstat_add(lock->lk_stat, &lc);
+        }
+#endif
+
         spinlock_release(&lock->lk_lock);
 }
 
@@ -348,3 +431,209 @@ cv_broadcast(struct cv *cv, struct lock *lock)
         // (void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	spinlock_setname(&rw->rw_lock, rw->rw_name);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 0;
+	rw->rw_readwait = 0;
+	rw->rw_writewait = 0;
+	rw->rw_readpass = 0;
+	rw->rw_writerun = 0;
+	rw->rw_writerburst = RWLOCK_WRITERBURST;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_readwait == 0 && rw->rw_writewait == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Wait on WC. Call with rw_lock held; it's held again on return.
+ */
+static
+void
+rwlock_wait(struct rwlock *rw, struct wchan *wc)
+{
+	wchan_lock(wc);
+	spinlock_release(&rw->rw_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&rw->rw_lock);
+}
+
+/*
+ * Decide who goes next, now that the writer has let go. Waiting
+ * readers go if no writer is waiting, or if the writers have had
+ * their burst; the ones waiting now get a pass to go ahead of the
+ * writers. Otherwise, once there are no readers left, one writer
+ * goes. Call with rw_lock held.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rw)
+{
+	KASSERT(rw->rw_writer == NULL);
+
+	if (rw->rw_readwait > 0 &&
+	    (rw->rw_writewait == 0 ||
+	     (rw->rw_writerburst > 0 &&
+	      rw->rw_writerun >= rw->rw_writerburst))) {
+		if (rw->rw_writewait > 0) {
+			rw->rw_readpass = rw->rw_readwait;
+		}
+		rw->rw_writerun = 0;
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	else if (rw->rw_writewait > 0 && rw->rw_readers == 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(!rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL ||
+	       (rw->rw_writewait > 0 && rw->rw_readpass == 0)) {
+		rw->rw_readwait++;
+		rwlock_wait(rw, rw->rw_readwchan);
+		rw->rw_readwait--;
+	}
+	if (rw->rw_readpass > 0) {
+		rw->rw_readpass--;
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_readpass == 0 &&
+	    rw->rw_writewait > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(!rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+	       rw->rw_readpass > 0) {
+		rw->rw_writewait++;
+		rwlock_wait(rw, rw->rw_writewchan);
+		rw->rw_writewait--;
+	}
+	rw->rw_writer = curthread;
+	if (rw->rw_readwait > 0) {
+		rw->rw_writerun++;
+	}
+	else {
+		rw->rw_writerun = 0;
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rw->rw_readers++;
+	/* Other readers may come in with us; writers still can't. */
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return (rw->rw_writer == curthread);
+}
+
+void
+rwlock_setfairness(struct rwlock *rw, unsigned writerburst)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writerburst = writerburst;
+	spinlock_release(&rw->rw_lock);
+}
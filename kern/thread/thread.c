@@ -50,13 +50,25 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem_cache.h>
+#include <zeropool.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Time slice at priority PRIO, in hardclocks. */
+#define SCHED_QUANTUM(prio)	(1U << (prio))
+
+/* How long a thread waits on a run queue before it's moved up. */
+#define SCHED_AGE_HARDCLOCKS	50
+
+/* How long after it last ran a thread's cache is taken to be warm. */
+#define SCHED_HOT_HARDCLOCKS	2
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -64,6 +76,22 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Caches of thread structures and wait channels, so that fork and
+ * exit (and lock and semaphore creation) mostly reuse ones that are
+ * already set up. Stacks come from kmalloc, which keeps a few
+ * recently freed page-sized blocks itself.
+ */
+static int thread_ctor(void *obj);
+static int wchan_ctor(void *obj);
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, NULL, 16);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, NULL, 32);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -111,6 +139,21 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor for thread_cache: the parts of a thread that are the
+ * same again by the time it's destroyed.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,22 +166,20 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* Thread subsystem fields (t_machdep, t_listnode: thread_ctor) */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -149,6 +190,12 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields: new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_quantum = SCHED_QUANTUM(0);
+	thread->t_readyclock = 0;
+	thread->t_ranclock = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -167,6 +214,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,14 +228,27 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_tlbgen = 0;
+	c->c_stealseed = hardware_number + 1;
+	c->c_kickclock = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NPRIO; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
+	c->c_shootdown_wchan = wchan_create("shootdown");
+	if (c->c_shootdown_wchan == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "ipi");
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -252,6 +313,12 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
+
+	/*
+	 * These only check that the thread is back in the state
+	 * thread_ctor left it in, which it needs to be to go back in
+	 * the cache.
+	 */
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,7 +326,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -289,6 +356,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +372,11 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NPRIO; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +497,205 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Run queues.
+ *
+ * Each cpu has one queue per priority. A ready thread goes on the
+ * one for its t_priority, and the cpu always runs the first thread
+ * of the highest priority that has one. All of these must be called
+ * with the cpu's runqueue lock held.
+ */
+
+/* Number of threads ready on C. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<SCHED_NPRIO; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/* Put T at the back of its priority's queue on C. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NPRIO);
+
+	/* (c_hardclocks may belong to another cpu; close is good enough) */
+	t->t_readyclock = c->c_hardclocks;
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+}
+
+/* Take the thread that should run next on C, or NULL if none. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NPRIO; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a thread from C for another cpu to run, or return NULL. This
+ * is the one that would run last, the lowest priority and the most
+ * recently queued, so the thread C is about to run stays put. But a
+ * thread that ran on C within the last SCHED_HOT_HARDCLOCKS probably
+ * still has its cache there, so any thread that hasn't is taken
+ * first; a hot one is taken only if there's nothing else, since an
+ * idle cpu costs more than a cold cache.
+ *
+ * C's current thread can be on C's run queue: if it went to sleep,
+ * C went idle with it still current, and it was woken before C had
+ * unidled. Taking it then would have two cpus on one stack, so
+ * it's skipped.
+ */
+static
+struct thread *
+runqueue_steal(struct cpu *c)
+{
+	struct thread *t, *hot;
+	unsigned i;
+
+	hot = NULL;
+	for (i=SCHED_NPRIO; i-- > 0; ) {
+		if (threadlist_isempty(&c->c_runqueue[i])) {
+			continue;
+		}
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (t == c->c_curthread) {
+				continue;
+			}
+			if (c->c_hardclocks - t->t_ranclock >=
+			    SCHED_HOT_HARDCLOCKS) {
+				threadlist_remove(&c->c_runqueue[i], t);
+				return t;
+			}
+			if (hot == NULL) {
+				hot = t;
+			}
+		}
+	}
+	if (hot != NULL) {
+		threadlist_remove(&c->c_runqueue[hot->t_priority], hot);
+	}
+	return hot;
+}
+
+/*
+ * Work stealing.
+ *
+ * There's no periodic load balancing. Instead a cpu that runs out of
+ * threads takes one from the back of another cpu's run queues (see
+ * runqueue_steal) before it goes idle. Victims are tried starting
+ * from a random cpu, so that idle cpus spread out over the busy ones
+ * rather than all piling onto the first. A cpu that is itself idle
+ * is left alone: whatever is on its queue was just put there and it
+ * is on its way to run it, on a cache that may still be warm.
+ *
+ * The first look at each victim is made without its lock. That can
+ * be wrong, but only means an extra try or a miss that the next
+ * pass round the idle loop catches, and it keeps idle cpus from
+ * bouncing the run queue locks of busy ones.
+ *
+ * Returns the stolen thread, now belonging to this cpu, or NULL.
+ * Call without holding any run queue lock.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *me, *victim;
+	struct thread *t;
+	unsigned i, numcpus, first;
+
+	me = curcpu->c_self;
+	numcpus = cpuarray_num(&allcpus);
+
+	/* xorshift; it only needs to be different each time */
+	me->c_stealseed ^= me->c_stealseed << 13;
+	me->c_stealseed ^= me->c_stealseed >> 17;
+	me->c_stealseed ^= me->c_stealseed << 5;
+	first = me->c_stealseed % numcpus;
+
+	for (i=0; i<numcpus; i++) {
+		victim = cpuarray_get(&allcpus, (first + i) % numcpus);
+		if (victim == me || victim->c_isidle ||
+		    runqueue_count(victim) == 0) {
+			continue;
+		}
+
+		spinlock_acquire(&victim->c_runqueue_lock);
+		t = victim->c_isidle ? NULL : runqueue_steal(victim);
+		spinlock_release(&victim->c_runqueue_lock);
+
+		if (t != NULL) {
+			/* Nobody else can get at it now; see thread_switch. */
+			t->t_cpu = me;
+			DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+			      t->t_name, victim->c_number, me->c_number);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Send IPI_UNIDLE to an idle cpu other than BUSY, if there is one,
+ * so that it goes round its idle loop and steals. c_isidle is read
+ * without the lock; a wrong guess costs a stray interrupt, or leaves
+ * it to the idle cpu's next hardclock.
+ *
+ * Only called when BUSY has more than one thread waiting, since one
+ * waiting thread will usually get its turn on BUSY before an idle
+ * cpu could be woken to take it. And no cpu is kicked more than once
+ * per tick of its own clock: if the last kick didn't get it going,
+ * its hardclock will.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus, now;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == busy || c == curcpu->c_self || !c->c_isidle) {
+			continue;
+		}
+		now = c->c_hardclocks;
+		if (c->c_kickclock != now) {
+			c->c_kickclock = now;
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +720,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +728,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (runqueue_count(targetcpu) > 1) {
+		/*
+		 * It's busy and threads are piling up; wake up an
+		 * idle cpu, if there is one, to come and steal one.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -574,12 +851,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu->c_self) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	cur->t_ranclock = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -627,15 +906,40 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to steal a thread from another
+	 * cpu. Failing that, spend the time zeroing pages for the VM
+	 * system's pool, or tearing down objects the kernel's caches
+	 * were asked to give back, one at a time so that anything that
+	 * becomes runnable meanwhile doesn't wait long. We're still at
+	 * splhigh here, so let interrupts in between pages, the same
+	 * way cpu_idle does; a wakeup or IPI taken then is seen next
+	 * time round the loop.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+#if OPT_A3
+			if (next == NULL) {
+				if (zeropool_refill() ||
+				    kmem_cache_reap_idle()) {
+					cpu_irqon();
+					cpu_irqoff();
+				}
+				else {
+					cpu_idle();
+				}
+			}
+#else
+			if (next == NULL) {
+				cpu_idle();
+			}
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -822,139 +1126,96 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Threads start at priority 0,
+ * the highest, and each priority has a time slice twice as long as
+ * the one above it. A thread that uses up its slice has been
+ * computing rather than waiting, so it drops a priority; one that is
+ * woken from a wait channel goes up one (see wchan_wakeup). The cpu
+ * always runs the highest-priority ready thread, round-robin among
+ * equals, and a running thread is preempted at the next hardclock
+ * if something of higher priority is waiting.
+ *
+ * So that compute-bound threads can't be starved forever by a stream
+ * of interactive ones, schedule() lets the penalty wear off: a thread
+ * that has waited SCHED_AGE_HARDCLOCKS on a run queue is moved up a
+ * priority.
  */
 
-void
-schedule(void)
-{
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
-
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Charge this hardclock to the current thread. Called from
+ * hardclock() on every tick.
  */
 void
-thread_consider_migration(void)
+thread_timeslice(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	struct thread *cur;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
-
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	unsigned i;
+	bool yield;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	/* Nothing is running in the idle loop; see thread_switch. */
+	if (curcpu->c_isidle) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
-
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	cur = curthread;
+	c = curcpu->c_self;
+	yield = false;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	KASSERT(cur->t_quantum > 0);
+	if (--cur->t_quantum == 0) {
+		if (cur->t_priority < SCHED_NPRIO-1) {
+			cur->t_priority++;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+		cur->t_quantum = SCHED_QUANTUM(cur->t_priority);
+		yield = true;
+	}
+	else {
+		for (i=0; i<cur->t_priority; i++) {
+			if (!threadlist_isempty(&c->c_runqueue[i])) {
+				yield = true;
+				break;
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	spinlock_release(&c->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (yield) {
+		thread_yield();
 	}
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * This is called periodically from hardclock(). It moves threads
+ * that have waited too long on the current cpu's run queues up a
+ * priority.
+ */
+void
+schedule(void)
+{
+	struct cpu *c;
+	struct thread *t;
+	unsigned i, n;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (i=1; i<SCHED_NPRIO; i++) {
+		/* Go once round the queue, keeping the order. */
+		for (n = c->c_runqueue[i].tl_count; n > 0; n--) {
+			t = threadlist_remhead(&c->c_runqueue[i]);
+			if (c->c_hardclocks - t->t_readyclock
+			    >= SCHED_AGE_HARDCLOCKS) {
+				t->t_priority = i-1;
+				t->t_quantum = SCHED_QUANTUM(i-1);
+				runqueue_add(c, t);
+			}
+			else {
+				threadlist_addtail(&c->c_runqueue[i], t);
+			}
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -976,26 +1237,38 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+	spinlock_setname(&wc->wc_lock, name);
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The corresponding cleanup functions require this.) That's also
+ * the state wchan_ctor leaves it in, so it can go straight back in
+ * the cache.
  */
 void
 wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(&wchan_cache, wc);
+}
+
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
 }
 
 /*
@@ -1028,6 +1301,23 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Make TARGET, just taken off a wait channel, runnable. It gave up
+ * the cpu without being made to, so it goes up a priority, with a
+ * fresh time slice. (Until it's on a run queue nobody else can get
+ * at it, so no lock is needed for that.)
+ */
+static
+void
+wchan_wakeup(struct thread *target)
+{
+	if (target->t_priority > 0) {
+		target->t_priority--;
+	}
+	target->t_quantum = SCHED_QUANTUM(target->t_priority);
+	thread_make_runnable(target, false);
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,7 +1340,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	wchan_wakeup(target);
 }
 
 /*
@@ -1084,7 +1374,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		wchan_wakeup(target);
 	}
 
 	threadlist_cleanup(&list);
@@ -1140,9 +1430,10 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	unsigned ticket;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
@@ -1151,15 +1442,77 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
-	else {
+	else if (n != TLBSHOOTDOWN_ALL) {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	ticket = ++target->c_shootdown_seq;
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	/* If one is already on its way, this goes with it. */
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	while ((int)(target->c_shootdown_done - ticket) < 0) {
+		wchan_lock(target->c_shootdown_wchan);
+		spinlock_release(&target->c_ipi_lock);
+		wchan_sleep(target->c_shootdown_wchan);
+		spinlock_acquire(&target->c_ipi_lock);
+	}
+	spinlock_release(&target->c_ipi_lock);
+}
+
+unsigned
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned tickets[32];
+	unsigned i, n;
+	uint32_t sent;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(cpuarray_num(&allcpus) <= 32);
+
+	/*
+	 * Don't move to another cpu until everyone has been told.
+	 * Waiting may sleep and we may wake up elsewhere, so remember
+	 * who was actually sent one rather than asking curcpu again.
+	 */
+	spl = splhigh();
+	n = 0;
+	sent = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		if ((cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			vm_tlbshootdown(mapping);
+		}
+		else {
+			tickets[i] = ipi_tlbshootdown(c, mapping);
+			sent |= (uint32_t)1 << i;
+			n++;
+		}
+	}
+	splx(spl);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		if ((sent & ((uint32_t)1 << i)) != 0) {
+			ipi_tlbshootdown_wait(cpuarray_get(&allcpus, i),
+					      tickets[i]);
+		}
+	}
+	return n;
 }
 
 void
@@ -1202,8 +1555,14 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		/* Not while holding the IPI lock; waking may send IPIs. */
+		wchan_wakeall(curcpu->c_shootdown_wchan);
+	}
 }
@@ -87,6 +87,16 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Protects knowndevs and the kd_fs fields. Looking up a device only
+ * needs it for reading, and doesn't need vfs_biglock, so lookups
+ * don't queue up behind each other; adding devices and mounting and
+ * unmounting need it for writing. When both are needed, get this
+ * first: FSOP_GETROOT and VOP_INCREF take vfs_biglock themselves, and
+ * lookups call them with this held.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,6 +113,11 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
@@ -154,6 +169,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
+	rwlock_acquire_read(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -165,22 +181,22 @@ vfs_sync(void)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_read(knowndevs_lock);
 
 	return 0;
 }
 
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
- * back an appropriate vnode.
+ * back an appropriate vnode. Call with knowndevs_lock held.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **result)
+findroot(const char *devname, struct vnode **result)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -250,6 +266,17 @@ vfs_getroot(const char *devname, struct vnode **result)
 	return ENODEV;
 }
 
+int
+vfs_getroot(const char *devname, struct vnode **result)
+{
+	int err;
+
+	rwlock_acquire_read(knowndevs_lock);
+	err = findroot(devname, result);
+	rwlock_release_read(knowndevs_lock);
+	return err;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -257,11 +284,13 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	name = NULL;
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,11 +303,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	rwlock_release_read(knowndevs_lock);
+	return name;
 }
 
 /*
@@ -338,7 +369,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -378,6 +409,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	unsigned index;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	name = kstrdup(dname);
@@ -413,6 +445,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 
 	if (badnames(name, rawname, volname)) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EEXIST;
 	}
 
@@ -424,6 +457,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 
  nomem:
@@ -442,6 +476,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 	
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return ENOMEM;
 }
 
@@ -470,7 +505,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold knowndevs_lock for writing.
  */
 static
 int
@@ -480,7 +515,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -514,25 +549,24 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto fail;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
-		return EBUSY;
+		result = EBUSY;
+		goto fail;
 	}
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto fail;
 	}
 
 	KASSERT(fs != NULL);
@@ -543,8 +577,10 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
+ fail:
 	vfs_biglock_release();
-	return 0;
+	rwlock_release_write(knowndevs_lock);
+	return result;
 }
 
 /*
@@ -557,6 +593,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -590,6 +627,7 @@ vfs_unmount(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -603,6 +641,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -651,6 +690,7 @@ vfs_unmountall(void)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 
 	return 0;
 }
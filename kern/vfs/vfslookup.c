@@ -75,14 +75,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -90,18 +87,18 @@ vfs_setbootfs(const char *fsname)
 		strcat(tmp, ":");
 	}
 
+	/* Not under vfs_biglock: the lookup takes the device list lock. */
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	change_bootfs(newguy);
 
 	vfs_biglock_release();
@@ -123,6 +120,10 @@ vfs_clearbootfs(void)
 /*
  * Common code to pull the device name, if any, off the front of a
  * path and choose the vnode to begin the name lookup relative to.
+ *
+ * Call without vfs_biglock, so that lookups on different devices
+ * don't wait for each other just to find where to start; vfs_getroot
+ * only needs the device list for reading.
  */
 
 static
@@ -133,7 +134,7 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(!vfs_biglock_do_i_hold());
 
 	/*
 	 * Locate the first colon or slash.
@@ -188,11 +189,15 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		/* bootfs_vnode is protected by vfs_biglock. */
+		vfs_biglock_acquire();
 		if (bootfs_vnode==NULL) {
+			vfs_biglock_release();
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		vfs_biglock_release();
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -235,14 +240,13 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
+	vfs_biglock_acquire();
+
 	if (strlen(path)==0) {
 		/*
 		 * It does not make sense to use just a device name in
@@ -267,20 +271,18 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	vfs_biglock_acquire();
+
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Coremap: physical page frame management.
+ *
+ * See coremap.h for the overall design. The coremap array itself
+ * lives at the bottom of the memory reported by ram_getsize(); the
+ * frames after it are the ones we hand out.
+ *
+ * Frame numbers (indices into the coremap) are used instead of
+ * pointers for the free list links, which keeps each entry small.
+ *
+ * Single-page user frames also record which address space and virtual
+ * page they back, plus referenced/dirty bits, so that the page-out
+ * code can run a clock (second chance) sweep over physical memory.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+
+/* States a frame can be in. */
+#define CME_FREE	0	/* first frame of a free block */
+#define CME_FREETAIL	1	/* any other frame of a free block */
+#define CME_ALLOC	2	/* first frame of an allocation */
+#define CME_ALLOCTAIL	3	/* any other frame of an allocation */
+
+/* Flags for user frames. */
+#define CMF_REF		0x1	/* touched since the clock hand last passed */
+#define CMF_DIRTY	0x2	/* differs from its backing store */
+#define CMF_BUSY	0x4	/* chosen for eviction */
+
+/* End-of-list marker for free list links. */
+#define CM_NONE		(-1)
+
+struct coremap_entry {
+	int cme_next;			/* free list link, if CME_FREE */
+	int cme_prev;			/* free list link, if CME_FREE */
+	unsigned cme_npages;		/* allocation size, if CME_ALLOC */
+	struct addrspace *cme_as;	/* owning address space, or NULL */
+	void *cme_kdata;		/* kernel allocator's data, if CME_ALLOC */
+	vaddr_t cme_vaddr;		/* user page, if cme_as != NULL */
+	uint16_t cme_refcount;		/* references, if CME_ALLOC */
+	uint8_t cme_order;		/* block order, if CME_FREE */
+	uint8_t cme_state;		/* CME_* */
+	uint8_t cme_flags;		/* CMF_*, if cme_as != NULL */
+};
+
+/* Most references a single frame can have. */
+#define CM_MAXREFS	0xffff
+
+static struct coremap_entry *coremap;
+static paddr_t coremap_base;		/* physical address of frame 0 */
+static unsigned coremap_nframes;	/* number of managed frames */
+static bool coremap_created = false;
+
+/* Free lists, one per order, and how many blocks are on each. */
+static int freelist[COREMAP_NORDERS];
+static unsigned freecount[COREMAP_NORDERS];
+static unsigned coremap_nfree;		/* total free frames */
+
+/* Clock hand for coremap_victim. */
+static unsigned coremap_hand;
+
+/*
+ * The coremap is used from the fault handler and from kmalloc, so a
+ * spinlock is the only choice.
+ */
+static struct spinlock coremap_lock = SPINLOCK_NAMED_INITIALIZER("coremap");
+
+#define FRAME_TO_PADDR(f)	(coremap_base + (paddr_t)(f) * PAGE_SIZE)
+#define PADDR_TO_FRAME(pa)	(((pa) - coremap_base) / PAGE_SIZE)
+
+////////////////////////////////////////////////////////////
+//
+// Free list handling.
+
+static
+void
+freelist_add(unsigned frame, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[frame];
+
+	KASSERT(order < COREMAP_NORDERS);
+	KASSERT(frame % (1U << order) == 0);
+
+	cme->cme_state = CME_FREE;
+	cme->cme_order = order;
+	cme->cme_prev = CM_NONE;
+	cme->cme_next = freelist[order];
+	if (freelist[order] != CM_NONE) {
+		coremap[freelist[order]].cme_prev = frame;
+	}
+	freelist[order] = frame;
+	freecount[order]++;
+}
+
+static
+void
+freelist_remove(unsigned frame)
+{
+	struct coremap_entry *cme = &coremap[frame];
+	unsigned order = cme->cme_order;
+
+	KASSERT(cme->cme_state == CME_FREE);
+	KASSERT(freecount[order] > 0);
+
+	if (cme->cme_prev != CM_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(freelist[order] == (int)frame);
+		freelist[order] = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_state = CME_FREETAIL;
+	freecount[order]--;
+}
+
+/*
+ * Put the block of 2^ORDER frames at FRAME back, merging it with its
+ * buddy for as long as the buddy is a free block of the same order.
+ */
+static
+void
+buddy_free_block(unsigned frame, unsigned order)
+{
+	unsigned buddy;
+
+	while (order + 1 < COREMAP_NORDERS) {
+		buddy = frame ^ (1U << order);
+		if (buddy + (1U << order) > coremap_nframes ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < frame) {
+			coremap[frame].cme_state = CME_FREETAIL;
+			frame = buddy;
+		}
+		order++;
+	}
+	freelist_add(frame, order);
+}
+
+/*
+ * Free the range of NPAGES frames starting at FRAME, splitting it into
+ * the largest aligned blocks that fit. Used both for whole allocations
+ * and for handing back the unused tail of a rounded-up block.
+ */
+static
+void
+buddy_free_range(unsigned frame, unsigned npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order + 1 < COREMAP_NORDERS &&
+		       frame % (2U << order) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		buddy_free_block(frame, order);
+		frame += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface.
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned total, cmpages, i;
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	/* Carve the coremap itself out of the bottom of memory. */
+	total = (hi - lo) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(total * sizeof(struct coremap_entry), PAGE_SIZE);
+	KASSERT(cmpages < total);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo + cmpages * PAGE_SIZE;
+	coremap_nframes = total - cmpages;
+
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		freelist[i] = CM_NONE;
+		freecount[i] = 0;
+	}
+	for (i=0; i<coremap_nframes; i++) {
+		coremap[i].cme_state = CME_FREETAIL;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_kdata = NULL;
+		coremap[i].cme_flags = 0;
+	}
+
+	buddy_free_range(0, coremap_nframes);
+	coremap_nfree = coremap_nframes;
+
+	coremap_created = true;
+
+	kprintf("coremap: %u frames managed, %u used by the coremap\n",
+		coremap_nframes, cmpages);
+}
+
+bool
+coremap_ready(void)
+{
+	return coremap_created;
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned order, have, frame, i;
+
+	KASSERT(coremap_created);
+	KASSERT(npages > 0);
+
+	/* Smallest order that holds the request. */
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+		if (order >= COREMAP_NORDERS) {
+			return 0;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	for (have = order; have < COREMAP_NORDERS; have++) {
+		if (freelist[have] != CM_NONE) {
+			break;
+		}
+	}
+	if (have == COREMAP_NORDERS) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	frame = freelist[have];
+	freelist_remove(frame);
+
+	/* Split down to the order we want, freeing the upper halves. */
+	while (have > order) {
+		have--;
+		freelist_add(frame + (1U << have), have);
+	}
+
+	/* Give back whatever we rounded up by. */
+	if (npages < (1UL << order)) {
+		buddy_free_range(frame + npages, (1U << order) - npages);
+	}
+
+	coremap[frame].cme_state = CME_ALLOC;
+	coremap[frame].cme_npages = npages;
+	coremap[frame].cme_refcount = 1;
+	coremap[frame].cme_as = NULL;
+	coremap[frame].cme_kdata = NULL;
+	coremap[frame].cme_flags = 0;
+	for (i=1; i<npages; i++) {
+		coremap[frame + i].cme_state = CME_ALLOCTAIL;
+		coremap[frame + i].cme_npages = 0;
+	}
+	coremap_nfree -= npages;
+
+	spinlock_release(&coremap_lock);
+
+	return FRAME_TO_PADDR(frame);
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned frame, npages, i;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!coremap_created || paddr < coremap_base) {
+		/* Stolen before the coremap existed; we can't take it back. */
+		return;
+	}
+
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT(frame < coremap_nframes);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap[frame].cme_state != CME_ALLOC) {
+		panic("coremap_free: 0x%x is not an allocated block\n", paddr);
+	}
+	KASSERT(coremap[frame].cme_refcount > 0);
+	coremap[frame].cme_refcount--;
+	if (coremap[frame].cme_refcount > 0) {
+		/* Still in use by someone else. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	npages = coremap[frame].cme_npages;
+	KASSERT(npages > 0 && frame + npages <= coremap_nframes);
+	coremap[frame].cme_as = NULL;
+	coremap[frame].cme_kdata = NULL;
+	coremap[frame].cme_flags = 0;
+
+	for (i=0; i<npages; i++) {
+		coremap[frame + i].cme_state = CME_FREETAIL;
+		coremap[frame + i].cme_npages = 0;
+	}
+	buddy_free_range(frame, npages);
+	coremap_nfree += npages;
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Look up the allocated block starting at PADDR. Call with the lock held.
+ */
+static
+unsigned
+coremap_getblock(paddr_t paddr)
+{
+	unsigned frame;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(paddr >= coremap_base);
+
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT(frame < coremap_nframes);
+	if (coremap[frame].cme_state != CME_ALLOC) {
+		panic("coremap: 0x%x is not an allocated block\n", paddr);
+	}
+	return frame;
+}
+
+void
+coremap_share(paddr_t paddr)
+{
+	unsigned frame;
+
+	spinlock_acquire(&coremap_lock);
+	frame = coremap_getblock(paddr);
+	if (coremap[frame].cme_refcount == CM_MAXREFS) {
+		panic("coremap: too many references to 0x%x\n", paddr);
+	}
+	coremap[frame].cme_refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned frame, refcount;
+
+	spinlock_acquire(&coremap_lock);
+	frame = coremap_getblock(paddr);
+	refcount = coremap[frame].cme_refcount;
+	spinlock_release(&coremap_lock);
+
+	return refcount;
+}
+
+unsigned
+coremap_npages(paddr_t paddr)
+{
+	unsigned frame, npages;
+
+	if (!coremap_created || paddr < coremap_base) {
+		return 0;
+	}
+	frame = PADDR_TO_FRAME(paddr);
+	if (frame >= coremap_nframes) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	npages = 0;
+	if (coremap[frame].cme_state == CME_ALLOC) {
+		npages = coremap[frame].cme_npages;
+	}
+	spinlock_release(&coremap_lock);
+
+	return npages;
+}
+
+void
+coremap_setkdata(paddr_t paddr, void *data)
+{
+	unsigned frame;
+
+	if (!coremap_created || paddr < coremap_base) {
+		/* Not ours; nowhere to put it. */
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	frame = coremap_getblock(paddr);
+	coremap[frame].cme_kdata = data;
+	spinlock_release(&coremap_lock);
+}
+
+void *
+coremap_getkdata(paddr_t paddr)
+{
+	unsigned frame;
+
+	/*
+	 * No locking: the caller holds the block, so the entry can't
+	 * change under us. This is on kfree's fast path.
+	 */
+	if (!coremap_created || paddr < coremap_base) {
+		return NULL;
+	}
+	frame = PADDR_TO_FRAME(paddr);
+	if (frame >= coremap_nframes || coremap[frame].cme_state != CME_ALLOC) {
+		return NULL;
+	}
+	return coremap[frame].cme_kdata;
+}
+
+bool
+coremap_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr, bool write)
+{
+	struct coremap_entry *cme;
+	bool writeable;
+
+	KASSERT(as != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[coremap_getblock(paddr)];
+	KASSERT(cme->cme_npages == 1);
+
+	if (cme->cme_refcount == 1 && cme->cme_as == NULL) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+	cme->cme_flags |= CMF_REF;
+	cme->cme_flags &= ~CMF_BUSY;
+	if (write) {
+		cme->cme_flags |= CMF_DIRTY;
+	}
+	writeable = cme->cme_refcount == 1 && (cme->cme_flags & CMF_DIRTY);
+	spinlock_release(&coremap_lock);
+
+	return writeable;
+}
+
+bool
+coremap_writeable(paddr_t paddr, struct addrspace *as)
+{
+	struct coremap_entry *cme;
+	bool writeable;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[coremap_getblock(paddr)];
+	KASSERT(cme->cme_npages == 1);
+	writeable = cme->cme_refcount == 1 && cme->cme_as == as &&
+		(cme->cme_flags & CMF_DIRTY);
+	spinlock_release(&coremap_lock);
+
+	return writeable;
+}
+
+void
+coremap_disown(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[coremap_getblock(paddr)];
+	cme->cme_as = NULL;
+	cme->cme_flags &= ~CMF_BUSY;
+	spinlock_release(&coremap_lock);
+}
+
+paddr_t
+coremap_victim(bool dirtyok, struct addrspace **as, vaddr_t *vaddr,
+	       bool *dirty)
+{
+	struct coremap_entry *cme;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+
+	/*
+	 * Two full turns: the first may do nothing but clear
+	 * referenced bits.
+	 */
+	for (i=0; i<2*coremap_nframes; i++) {
+		cme = &coremap[coremap_hand];
+		coremap_hand = (coremap_hand + 1) % coremap_nframes;
+
+		if (cme->cme_state != CME_ALLOC || cme->cme_as == NULL ||
+		    cme->cme_refcount != 1 || (cme->cme_flags & CMF_BUSY)) {
+			continue;
+		}
+		if (!dirtyok && (cme->cme_flags & CMF_DIRTY)) {
+			continue;
+		}
+		if (cme->cme_flags & CMF_REF) {
+			/* Second chance. */
+			cme->cme_flags &= ~CMF_REF;
+			continue;
+		}
+
+		cme->cme_flags |= CMF_BUSY;
+		*as = cme->cme_as;
+		*vaddr = cme->cme_vaddr;
+		*dirty = (cme->cme_flags & CMF_DIRTY) != 0;
+		spinlock_release(&coremap_lock);
+		return FRAME_TO_PADDR(cme - coremap);
+	}
+
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+void
+coremap_printstats(void)
+{
+	unsigned counts[COREMAP_NORDERS];
+	unsigned nfree, i;
+
+	if (!coremap_created) {
+		kprintf("Physical page allocator not initialized\n");
+		return;
+	}
+
+	/* Take a snapshot so we don't kprintf with the lock held. */
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		counts[i] = freecount[i];
+	}
+	nfree = coremap_nfree;
+	spinlock_release(&coremap_lock);
+
+	kprintf("Physical page allocator status: %u/%u frames free\n",
+		nfree, coremap_nframes);
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		kprintf("   order %2u (%6u pages): %u free\n",
+			i, 1U << i, counts[i]);
+	}
+}
@@ -29,8 +29,17 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kmem_cache.h>
+#include <kprof.h>
+
+#include "opt-kprof.h"
+#include "opt-kmalloc_pow2.h"
 
 /*
  * Kernel malloc.
@@ -83,8 +92,26 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
+/*
+ * By default the sizes go up alternately by half and by a third, so
+ * a block is never more than a third bigger than it needs to be and
+ * things like sfs_vnode (just over 512 bytes) don't take twice their
+ * size. Each still packs into a page with at most 256 bytes left over
+ * at the end. (1536 would break the pattern on purpose: only two fit
+ * in a page, the same as 2048, so it would save nothing.)
+ *
+ * "options kmalloc_pow2" goes back to powers of two; "kh" shows how
+ * well either fits the current load.
+ */
+#if OPT_KMALLOC_POW2
 #define NSIZES 8
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#else
+#define NSIZES 14
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048
+};
+#endif
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -104,6 +131,8 @@ struct freelist {
 struct pageref {
 	struct pageref *next_samesize;
 	struct pageref *next_all;
+	struct pageref **prev_samesize;	/* link pointing at us */
+	struct pageref **prev_all;	/* likewise */
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,67 +147,130 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Pagerefs come from a free list (linked through next_samesize) that
+ * grows a page at a time as the heap does. The first page of them is
+ * in the kernel BSS, so that there are some before there is anything
+ * to allocate pages from. Pages of pagerefs are never given back;
+ * they're small next to the heap they describe.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Note that this cannot recursively use the subpage allocator, so
+ * growing the pool is up to the caller: see subpage_kmalloc.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+static struct pageref pagerefs_boot[NPAGEREFS_PER_PAGE];
+static bool pagerefs_boot_used;
+
+static struct pageref *pagerefs_free;
+static unsigned npagerefs;	/* total, free or not */
+
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	for (i=0; i<n; i++) {
+		prs[i].pageaddr_and_blocktype = 0;
+		prs[i].next_samesize = pagerefs_free;
+		pagerefs_free = &prs[i];
+	}
+	npagerefs += n;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (pagerefs_free == NULL && !pagerefs_boot_used) {
+		addpagerefs(pagerefs_boot, NPAGEREFS_PER_PAGE);
+		pagerefs_boot_used = true;
 	}
 
-	/* ran out */
-	return NULL;
+	pr = pagerefs_free;
+	if (pr == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	pagerefs_free = pr->next_samesize;
+	KASSERT(pr->pageaddr_and_blocktype == 0);
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(p->pageaddr_and_blocktype != 0);
+	p->pageaddr_and_blocktype = 0;
+	p->next_samesize = pagerefs_free;
+	pagerefs_free = p;
+}
+
+/*
+ * Finding the pageref for a block being freed: pages allocated once
+ * the coremap exists have a back-pointer there (coremap_setkdata).
+ * The few allocated before it did are listed here instead.
+ */
+#define NEARLYPAGES 64
+static struct pageref *earlypages[NEARLYPAGES];
+static unsigned nearlypages;
+
+/*
+ * Record (or, if PR is NULL, forget) PR as the pageref for the page at
+ * PRPAGE. Call with kmalloc_spinlock held.
+ */
+static
+void
+setpageref(vaddr_t prpage, struct pageref *pr)
+{
+	unsigned i;
+
+	if (pr == NULL) {
+		for (i=0; i<nearlypages; i++) {
+			if (PR_PAGEADDR(earlypages[i]) == prpage) {
+				earlypages[i] = earlypages[--nearlypages];
+				return;
+			}
+		}
+	}
+
+	if (coremap_ready()) {
+		/* Everything since has come from the coremap. */
+		coremap_setkdata(KVADDR_TO_PADDR(prpage), pr);
+		return;
+	}
+
+	KASSERT(pr != NULL);
+	if (nearlypages == NEARLYPAGES) {
+		panic("kmalloc: too many pages before the coremap\n");
+	}
+	earlypages[nearlypages++] = pr;
+}
+
+/*
+ * Return the pageref for the page at PRPAGE, or NULL if it isn't a
+ * subpage page. Call with kmalloc_spinlock held.
+ */
+static
+struct pageref *
+findpageref(vaddr_t prpage)
+{
+	struct pageref *pr;
+	unsigned i;
+
+	pr = coremap_getkdata(KVADDR_TO_PADDR(prpage));
+	if (pr != NULL) {
+		return pr;
+	}
+	for (i=0; i<nearlypages; i++) {
+		if (PR_PAGEADDR(earlypages[i]) == prpage) {
+			return earlypages[i];
+		}
+	}
+	return NULL;
 }
 
 ////////////////////////////////////////
@@ -189,13 +281,62 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole page-level allocator (the "depot").
+ * Most allocations and frees never get that far, though: each cpu
+ * keeps a magazine of free blocks of each size, and only goes to the
+ * depot when the magazine runs empty (to take half a magazine's worth)
+ * or full (to give half back).
+ *
+ * A magazine is only touched by its own cpu, with interrupts off, so
+ * it needs no lock. Holding kmalloc_spinlock also keeps interrupts
+ * off, so the depot code can refill the current cpu's magazine too.
+ *
+ * To find the size of a block being freed without searching allbase
+ * under the lock, each page's pageref is recorded in the coremap.
+ * Pages allocated before the coremap existed don't have that, so
+ * their blocks skip the magazines.
+ *
+ * For the fragmentation report, each cpu also counts the blocks of
+ * each size that are live and the bytes asked for in them, adding on
+ * kmalloc and taking off on kfree. A block may be freed on another
+ * cpu than it came from, so one cpu's counts can go negative; only
+ * the sum means anything. kfree doesn't know the size asked for, so
+ * kmalloc writes it in the unused end of the block along with a check
+ * value (see subpage_settag). Blocks with less than SUBPAGE_TAGSIZE
+ * bytes to spare aren't tagged and count as full, so the requested
+ * figure can be a few bytes high per block. Counts made with no
+ * magazines to put them in go in kmalloc_nocpu instead.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_NAMED_INITIALIZER("kmalloc");
+
+#define KMALLOC_MAXCPUS	32	/* any further cpus skip the magazines */
+#define MAG_ROUNDS	8	/* blocks per magazine */
+
+struct magazine {
+	unsigned m_nrounds;
+	void *m_rounds[MAG_ROUNDS];
+};
+
+struct kmalloc_cpu {
+	struct magazine kc_mags[NSIZES];
+	unsigned kc_hits;	/* allocations served by a magazine */
+	unsigned kc_misses;	/* allocations that went to the depot */
+	unsigned kc_frees;	/* frees into a magazine */
+	unsigned kc_flushes;	/* frees that found the magazine full */
+	int kc_live[NSIZES];		/* blocks of each size live */
+	int kc_livereq[NSIZES];		/* bytes asked for in them */
+};
+
+static struct kmalloc_cpu kmalloc_cpus[KMALLOC_MAXCPUS];
+
+static struct spinlock kmalloc_nocpu_lock =
+	SPINLOCK_NAMED_INITIALIZER("kmalloc_nocpu");
+static struct kmalloc_cpu kmalloc_nocpu;	/* only kc_live, kc_livereq */
+
+/* Bytes at the end of a block used for the requested size. */
+#define SUBPAGE_TAGSIZE	(2 * sizeof(uint16_t))
+#define SUBPAGE_TAGMAGIC	0x6b6d
 
 ////////////////////////////////////////
 
@@ -260,14 +401,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -330,10 +471,20 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void large_printstats(void);
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmalloc_cpu *kc;
+	unsigned i, j, held, allocs;
+	unsigned pages[NSIZES];
+	int live, reqbytes, allocbytes;
+
+	for (i=0; i<NSIZES; i++) {
+		pages[i] = 0;
+	}
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -342,9 +493,63 @@ kheap_printstats(void)
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
+		pages[PR_BLOCKTYPE(pr)]++;
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	/*
+	 * Fragmentation by size: the space in the blocks that are live
+	 * now against what was asked for in them, and how much of each
+	 * page is too small to hold another block. Blocks sitting in
+	 * magazines are free, not live. The per-cpu counts aren't
+	 * locked, so this may be a little off if the heap is busy.
+	 */
+	kprintf("Size classes:\n");
+	kprintf("  size pages   live  requested  allocated waste slack\n");
+	for (i=0; i<NSIZES; i++) {
+		live = kmalloc_nocpu.kc_live[i];
+		reqbytes = kmalloc_nocpu.kc_livereq[i];
+		for (j=0; j<KMALLOC_MAXCPUS; j++) {
+			kc = &kmalloc_cpus[j];
+			live += kc->kc_live[i];
+			reqbytes += kc->kc_livereq[i];
+		}
+		if (live == 0 && pages[i] == 0) {
+			continue;
+		}
+		allocbytes = live * (int)sizes[i];
+		kprintf("  %4lu %5u %6d %10d %10d %4d%% %5u\n",
+			(unsigned long)sizes[i], pages[i], live,
+			reqbytes, allocbytes,
+			allocbytes > 0 ? (allocbytes - reqbytes) * 100 /
+			allocbytes : 0,
+			pages[i] * (unsigned)(PAGE_SIZE % sizes[i]));
+	}
+
+	/* Magazine counters aren't locked; they may be slightly off. */
+	kprintf("Per-cpu magazines:\n");
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		kc = &kmalloc_cpus[i];
+		if (kc->kc_hits + kc->kc_misses + kc->kc_frees == 0) {
+			continue;
+		}
+		held = 0;
+		for (j=0; j<NSIZES; j++) {
+			held += kc->kc_mags[j].m_nrounds;
+		}
+		allocs = kc->kc_hits + kc->kc_misses;
+		kprintf("cpu%u: %u allocs, %u%% hit; %u frees, %u%% hit; "
+			"%u blocks held\n", i,
+			allocs, allocs ? kc->kc_hits * 100 / allocs : 0,
+			kc->kc_frees, kc->kc_frees ?
+			(kc->kc_frees - kc->kc_flushes) * 100 / kc->kc_frees : 0,
+			held);
+	}
+
+	large_printstats();
+	kmem_cache_printstats();
+	coremap_printstats();
 }
 
 ////////////////////////////////////////
@@ -353,24 +558,16 @@ static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
 	}
 }
 
@@ -392,6 +589,358 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of PR, which must have one.
+ * Call with kmalloc_spinlock held.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put the block at OFFSET back on the freelist of PR. If that makes
+ * the whole page free, the page is taken off the lists and true is
+ * returned; the caller should then free_kpages it, after dropping
+ * kmalloc_spinlock. Call with kmalloc_spinlock held.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		setpageref(prpage, NULL);
+		freepageref(pr);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Return the current cpu's allocator state, or NULL if it doesn't have
+ * any (because it's too early in boot, or there are too many cpus).
+ * Call with interrupts off.
+ */
+static
+struct kmalloc_cpu *
+kmalloc_curcpu(void)
+{
+	if (!CURCPU_EXISTS() || curcpu->c_number >= KMALLOC_MAXCPUS) {
+		return NULL;
+	}
+	return &kmalloc_cpus[curcpu->c_number];
+}
+
+/*
+ * Top up the current cpu's BLKTYPE magazine to half full from pages
+ * that already have free blocks, so that the next few allocations
+ * don't need the depot. Call with kmalloc_spinlock held.
+ */
+static
+void
+magazine_refill(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	struct pageref *pr;
+
+	kc = kmalloc_curcpu();
+	if (kc == NULL) {
+		return;
+	}
+	mag = &kc->kc_mags[blktype];
+
+	for (pr = sizebases[blktype];
+	     pr != NULL && mag->m_nrounds < MAG_ROUNDS/2;
+	     pr = pr->next_samesize) {
+		while (pr->nfree > 0 && mag->m_nrounds < MAG_ROUNDS/2) {
+			mag->m_rounds[mag->m_nrounds++] =
+				subpage_takeblock(pr);
+		}
+	}
+}
+
+/*
+ * Record that PTR, a block of type BLKTYPE, was given out for REQSZ
+ * bytes, by writing REQSZ and a check value derived from PTR in its
+ * last SUBPAGE_TAGSIZE bytes, if the caller won't be using them.
+ */
+static
+void
+subpage_settag(void *ptr, unsigned blktype, size_t reqsz)
+{
+	uint16_t *tag;
+
+	if (reqsz + SUBPAGE_TAGSIZE > sizes[blktype]) {
+		return;
+	}
+	tag = (uint16_t *)((vaddr_t)ptr + sizes[blktype] - SUBPAGE_TAGSIZE);
+	tag[0] = reqsz;
+	tag[1] = (uint16_t)((vaddr_t)ptr >> 4) ^ reqsz ^ SUBPAGE_TAGMAGIC;
+}
+
+/*
+ * Return the size asked for when PTR, a block of type BLKTYPE, was
+ * given out: the one in its tag, or the whole block if there isn't
+ * a valid one. Call before the block is filled with 0xdeadbeef.
+ */
+static
+size_t
+subpage_gettag(void *ptr, unsigned blktype)
+{
+	uint16_t *tag;
+
+	tag = (uint16_t *)((vaddr_t)ptr + sizes[blktype] - SUBPAGE_TAGSIZE);
+	if (tag[0] + SUBPAGE_TAGSIZE <= sizes[blktype] &&
+	    tag[1] == (((uint16_t)((vaddr_t)ptr >> 4) ^ tag[0] ^
+			SUBPAGE_TAGMAGIC) & 0xffff)) {
+		return tag[0];
+	}
+	return sizes[blktype];
+}
+
+/*
+ * Add NBLOCKS blocks of type BLKTYPE, with REQBYTES bytes asked for
+ * in them, to the live counts (or take them off, if negative).
+ */
+static
+void
+subpage_count(unsigned blktype, int nblocks, int reqbytes)
+{
+	struct kmalloc_cpu *kc;
+	int spl;
+
+	spl = splhigh();
+	kc = kmalloc_curcpu();
+	if (kc != NULL) {
+		kc->kc_live[blktype] += nblocks;
+		kc->kc_livereq[blktype] += reqbytes;
+	}
+	else {
+		spinlock_acquire(&kmalloc_nocpu_lock);
+		kmalloc_nocpu.kc_live[blktype] += nblocks;
+		kmalloc_nocpu.kc_livereq[blktype] += reqbytes;
+		spinlock_release(&kmalloc_nocpu_lock);
+	}
+	splx(spl);
+}
+
+/*
+ * Take a block of type BLKTYPE from the current cpu's magazine, or
+ * return NULL if it's empty.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	void *retptr;
+	int spl;
+
+	retptr = NULL;
+	spl = splhigh();
+	kc = kmalloc_curcpu();
+	if (kc != NULL) {
+		mag = &kc->kc_mags[blktype];
+		if (mag->m_nrounds > 0) {
+			retptr = mag->m_rounds[--mag->m_nrounds];
+			kc->kc_hits++;
+		}
+		else {
+			kc->kc_misses++;
+		}
+	}
+	splx(spl);
+
+	return retptr;
+}
+
+/*
+ * Put PTR, a block on the page described by PR, into the current
+ * cpu's magazine. If the magazine is full, the older half of it goes
+ * back to the depot first. Returns false, without doing anything, if
+ * this cpu has no magazines.
+ */
+static
+bool
+magazine_free(struct pageref *pr, void *ptr)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	struct pageref *blkpr;
+	vaddr_t blkaddr, freepages[MAG_ROUNDS/2];
+	unsigned i, nfreepages;
+	int blktype, spl;
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	/* Check for proper positioning and alignment */
+	if (((vaddr_t)ptr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	nfreepages = 0;
+	spl = splhigh();
+
+	kc = kmalloc_curcpu();
+	if (kc == NULL) {
+		splx(spl);
+		return false;
+	}
+	mag = &kc->kc_mags[blktype];
+
+	kc->kc_live[blktype]--;
+	kc->kc_livereq[blktype] -= subpage_gettag(ptr, blktype);
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	if (mag->m_nrounds == MAG_ROUNDS) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (i=0; i<MAG_ROUNDS/2; i++) {
+			blkaddr = (vaddr_t)mag->m_rounds[i];
+			/* (magazine_refill may have used an early page) */
+			blkpr = findpageref(blkaddr & PAGE_FRAME);
+			KASSERT(blkpr != NULL);
+			if (subpage_putblock(blkpr,
+					     blkaddr - PR_PAGEADDR(blkpr))) {
+				freepages[nfreepages++] = blkaddr & PAGE_FRAME;
+			}
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+
+		for (i=MAG_ROUNDS/2; i<MAG_ROUNDS; i++) {
+			mag->m_rounds[i - MAG_ROUNDS/2] = mag->m_rounds[i];
+		}
+		mag->m_nrounds -= MAG_ROUNDS/2;
+		kc->kc_flushes++;
+	}
+	mag->m_rounds[mag->m_nrounds++] = ptr;
+	kc->kc_frees++;
+
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return true;
+}
+
+/*
+ * Give everything in the current cpu's magazines back to the depot,
+ * and free any pages that leaves entirely free. Other cpus' magazines
+ * are left alone; only they can touch them. Returns false if no pages
+ * were freed.
+ */
+static
+bool
+magazine_drain(void)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	struct pageref *blkpr;
+	vaddr_t blkaddr, freepages[NSIZES * MAG_ROUNDS];
+	unsigned i, j, nfreepages;
+	int spl;
+
+	nfreepages = 0;
+	spl = splhigh();
+
+	kc = kmalloc_curcpu();
+	if (kc == NULL) {
+		splx(spl);
+		return false;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<NSIZES; i++) {
+		mag = &kc->kc_mags[i];
+		for (j=0; j<mag->m_nrounds; j++) {
+			blkaddr = (vaddr_t)mag->m_rounds[j];
+			blkpr = findpageref(blkaddr & PAGE_FRAME);
+			KASSERT(blkpr != NULL);
+			if (subpage_putblock(blkpr,
+					     blkaddr - PR_PAGEADDR(blkpr))) {
+				freepages[nfreepages++] = blkaddr & PAGE_FRAME;
+			}
+		}
+		mag->m_nrounds = 0;
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return nfreepages > 0;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -399,6 +948,7 @@ subpage_kmalloc(size_t sz)
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t prpool;		// new page of pagerefs
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
@@ -407,7 +957,13 @@ subpage_kmalloc(size_t sz)
 
 
 	blktype = blocktype(sz);
-	sz = sizes[blktype];
+
+	retptr = magazine_alloc(blktype);
+	if (retptr != NULL) {
+		subpage_settag(retptr, blktype, sz);
+		subpage_count(blktype, 1, sz);
+		return retptr;
+	}
 
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -423,29 +979,17 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+			retptr = subpage_takeblock(pr);
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			/* Might as well stock up while we have the lock. */
+			magazine_refill(blktype);
 
 			checksubpages();
 
 			spinlock_release(&kmalloc_spinlock);
+
+			subpage_settag(retptr, blktype, sz);
+			subpage_count(blktype, 1, sz);
 			return retptr;
 		}
 	}
@@ -469,6 +1013,17 @@ subpage_kmalloc(size_t sz)
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
+	if (pr==NULL) {
+		/* Grow the pageref pool; again, not holding the lock. */
+		spinlock_release(&kmalloc_spinlock);
+		prpool = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (prpool != 0) {
+			addpagerefs((struct pageref *)prpool,
+				    NPAGEREFS_PER_PAGE);
+		}
+		pr = allocpageref();
+	}
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -499,11 +1054,22 @@ subpage_kmalloc(size_t sz)
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
 	pr->next_samesize = sizebases[blktype];
+	pr->prev_samesize = &sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
+	}
 	sizebases[blktype] = pr;
 
 	pr->next_all = allbase;
+	pr->prev_all = &allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = &pr->next_all;
+	}
 	allbase = pr;
 
+	/* So kfree can find the pageref without searching. */
+	setpageref(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -516,27 +1082,23 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
 
+	/* The usual case: a page we know about, so use the magazine. */
+	pr = coremap_getkdata(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME));
+	if (pr != NULL && magazine_free(pr, ptr)) {
+		return 0;
+	}
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
+	if (pr == NULL) {
+		/* A page from before the coremap, or not a subpage block. */
+		pr = findpageref(ptraddr & PAGE_FRAME);
 	}
 
 	if (pr==NULL) {
@@ -545,6 +1107,13 @@ subpage_kfree(void *ptr)
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -552,32 +1121,15 @@ subpage_kfree(void *ptr)
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
+	subpage_count(blktype, -1, -(int)subpage_gettag(ptr, blktype));
+
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_putblock(pr, offset)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -598,37 +1150,191 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Multi-page allocations.
+//
+//    These come straight from alloc_kpages. The coremap remembers how
+//    many pages each block is, so free_kpages gives all of them back.
+//    (Blocks from before the coremap existed can't be given back, and
+//    aren't counted here either.)
+//
+//    A few recently freed blocks of each size up to LARGE_CACHE_PAGES
+//    pages are kept for reuse, since the same sizes (stacks, path and
+//    argument buffers) tend to come and go. They're given back when
+//    memory runs short; see kheap_reclaim.
+//
+
+#define LARGE_CACHE_PAGES 4	/* largest block size kept, in pages */
+#define LARGE_CACHE_DEPTH 4	/* blocks kept of each size */
+
+static vaddr_t largecache[LARGE_CACHE_PAGES][LARGE_CACHE_DEPTH];
+static unsigned largecache_num[LARGE_CACHE_PAGES];
+
+static unsigned large_live;		/* blocks allocated */
+static unsigned large_livepages;	/* pages in them */
+static unsigned large_hits;		/* allocations from largecache */
+static unsigned large_misses;		/* cacheable ones that weren't */
+
+static struct spinlock large_lock = SPINLOCK_NAMED_INITIALIZER("kmalloc_large");
+
+static
 void *
-kmalloc(size_t sz)
+large_kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
+	unsigned long npages;
+	vaddr_t address;
+
+	/* Round up to a whole number of pages. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+
+	address = 0;
+	spinlock_acquire(&large_lock);
+	if (npages <= LARGE_CACHE_PAGES) {
+		if (largecache_num[npages-1] > 0) {
+			address = largecache[npages-1]
+				[--largecache_num[npages-1]];
+			large_hits++;
+		}
+		else {
+			large_misses++;
+		}
+	}
+	spinlock_release(&large_lock);
 
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	if (address == 0) {
 		address = alloc_kpages(npages);
 		if (address==0) {
 			return NULL;
 		}
+	}
 
-		return (void *)address;
+	if (coremap_npages(KVADDR_TO_PADDR(address)) != 0) {
+		spinlock_acquire(&large_lock);
+		large_live++;
+		large_livepages += npages;
+		spinlock_release(&large_lock);
 	}
 
-	return subpage_kmalloc(sz);
+	return (void *)address;
+}
+
+static
+void
+large_kfree(void *ptr)
+{
+	vaddr_t address = (vaddr_t)ptr;
+	unsigned npages;
+
+	KASSERT(address%PAGE_SIZE==0);
+
+	npages = coremap_npages(KVADDR_TO_PADDR(address));
+	if (npages == 0) {
+		/* From before the coremap; nothing we can do with it. */
+		free_kpages(address);
+		return;
+	}
+
+	spinlock_acquire(&large_lock);
+	KASSERT(large_live > 0 && large_livepages >= npages);
+	large_live--;
+	large_livepages -= npages;
+	if (npages <= LARGE_CACHE_PAGES &&
+	    largecache_num[npages-1] < LARGE_CACHE_DEPTH) {
+		largecache[npages-1][largecache_num[npages-1]++] = address;
+		address = 0;
+	}
+	spinlock_release(&large_lock);
+
+	if (address != 0) {
+		free_kpages(address);
+	}
+}
+
+/*
+ * Give back the blocks in the multi-page cache, and any pages the
+ * current cpu's magazines were keeping from being freed. Returns false
+ * if there weren't any.
+ */
+bool
+kheap_reclaim(void)
+{
+	vaddr_t address;
+	unsigned i;
+	bool any;
+
+	any = magazine_drain();
+	for (i=0; i<LARGE_CACHE_PAGES; i++) {
+		while (1) {
+			spinlock_acquire(&large_lock);
+			if (largecache_num[i] == 0) {
+				spinlock_release(&large_lock);
+				break;
+			}
+			address = largecache[i][--largecache_num[i]];
+			spinlock_release(&large_lock);
+
+			free_kpages(address);
+			any = true;
+		}
+	}
+	return any;
+}
+
+static
+void
+large_printstats(void)
+{
+	unsigned i;
+
+	/* Not worth locking for a printout. */
+	kprintf("Multi-page allocations: %u blocks, %u pages; "
+		"cache %u hits, %u misses; cached:",
+		large_live, large_livepages, large_hits, large_misses);
+	for (i=0; i<LARGE_CACHE_PAGES; i++) {
+		kprintf(" %u x %up", largecache_num[i], i+1);
+	}
+	kprintf("\n");
+}
+
+//
+////////////////////////////////////////////////////////////
+
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+
+	if (sz>=LARGEST_SUBPAGE_SIZE) {
+		ptr = large_kmalloc(sz);
+	}
+	else {
+		ptr = subpage_kmalloc(sz);
+	}
+
+#if OPT_KPROF
+	if (ptr != NULL) {
+		kprof_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	}
+#endif
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+#if OPT_KPROF
+	if (ptr != NULL) {
+		kprof_free(ptr);
+	}
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
 	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+		large_kfree(ptr);
 	}
 }
-
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmem_cache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem_cache.h>
+
+/*
+ * All caches that have ever been used. Caches are only ever
+ * added, at the head, so the list can be walked without the lock once
+ * the head has been read.
+ */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_NAMED_INITIALIZER("kmem_caches");
+
+/*
+ * Set by kmem_cache_reap when caches with destructors were holding
+ * objects; the idle loop destroys those. Protected by kmem_caches_lock.
+ */
+static bool kmem_caches_reapwanted;
+
+static
+void
+kmem_cache_register(struct kmem_cache *kc)
+{
+	spinlock_acquire(&kmem_caches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
+/*
+ * Destroy and free an object that the cache isn't keeping.
+ */
+static
+void
+kmem_cache_destroy_obj(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	if (!kc->kc_listed) {
+		/* First use. */
+		kmem_cache_register(kc);
+	}
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+	KASSERT(kc->kc_maxfree <= KMEM_CACHE_MAXFREE);
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree < kc->kc_maxfree) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	kmem_cache_destroy_obj(kc, obj);
+}
+
+/*
+ * Take one retained object from KC, or return NULL if it has none.
+ */
+static
+void *
+kmem_cache_take(struct kmem_cache *kc)
+{
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	obj = kc->kc_nfree > 0 ? kc->kc_free[--kc->kc_nfree] : NULL;
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+bool
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	void *obj;
+	bool any, later;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	/*
+	 * We may be inside kmalloc on behalf of anything at all,
+	 * including a destructor, so destructors can't be run from
+	 * here. Objects without one are just memory.
+	 */
+	any = later = false;
+	for (; kc != NULL; kc = kc->kc_next) {
+		if (kc->kc_dtor != NULL) {
+			later = later || kc->kc_nfree > 0;
+			continue;
+		}
+		while ((obj = kmem_cache_take(kc)) != NULL) {
+			kfree(obj);
+			any = true;
+		}
+	}
+
+	if (later) {
+		spinlock_acquire(&kmem_caches_lock);
+		kmem_caches_reapwanted = true;
+		spinlock_release(&kmem_caches_lock);
+	}
+	return any;
+}
+
+bool
+kmem_cache_reap_idle(void)
+{
+	struct kmem_cache *kc;
+	void *obj;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches_reapwanted ? kmem_caches : NULL;
+	spinlock_release(&kmem_caches_lock);
+
+	/* Destructors may free things into other caches; hold no locks. */
+	for (; kc != NULL; kc = kc->kc_next) {
+		if (kc->kc_dtor == NULL) {
+			continue;
+		}
+		obj = kmem_cache_take(kc);
+		if (obj != NULL) {
+			kmem_cache_destroy_obj(kc, obj);
+			return true;
+		}
+	}
+
+	spinlock_acquire(&kmem_caches_lock);
+	kmem_caches_reapwanted = false;
+	spinlock_release(&kmem_caches_lock);
+	return false;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	/* Not worth locking each cache for a printout. */
+	kprintf("Object caches:\n");
+	for (; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-12s size %-5lu %2u/%-2u retained; %u allocs, %u%% hit\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_nfree, kc->kc_maxfree,
+			kc->kc_hits + kc->kc_misses,
+			kc->kc_hits + kc->kc_misses ?
+			kc->kc_hits * 100 / (kc->kc_hits + kc->kc_misses) : 0);
+	}
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * kmalloc allocation-site profiler. See kprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kprof.h>
+
+/* Site 0 collects everything that didn't get a slot of its own. */
+#define KPROF_OTHER	0
+
+/*
+ * The live blocks are split into stripes by address, each with its
+ * own lock, free list, hash chains, and per-site counters, so that
+ * kmallocs on different cpus don't all queue on one lock. A block is
+ * always freed through the stripe it was allocated in. The site
+ * table itself is shared: a slot is claimed once, under
+ * kprof_sitelock, and never changes after that, so looking a site up
+ * takes no lock.
+ */
+#define KPROF_NSTRIPES	8	/* power of 2 */
+#define KPROF_STRIPEBLOCKS	(KPROF_NBLOCKS / KPROF_NSTRIPES)
+#define KPROF_STRIPEBUCKETS	(KPROF_STRIPEBLOCKS / 4)
+
+/* One site's counters within one stripe. */
+struct kprof_count {
+	size_t kc_live;		/* bytes allocated and not freed */
+	size_t kc_peak;		/* most kc_live has been */
+	unsigned kc_blocks;	/* blocks allocated and not freed */
+	unsigned kc_allocs;	/* allocations, ever */
+};
+
+/* A live block, on a hash chain (or the free list) by index. */
+struct kprof_block {
+	void *kb_ptr;
+	uint32_t kb_size;
+	uint16_t kb_site;
+	uint16_t kb_next;
+};
+
+#define KPROF_NONE	0xffff
+
+struct kprof_stripe {
+	struct spinlock ks_lock;
+	bool ks_initialized;
+	uint16_t ks_freeblocks;
+	unsigned ks_untracked;	/* allocations with no block free */
+	uint16_t ks_buckets[KPROF_STRIPEBUCKETS];
+	struct kprof_block ks_blocks[KPROF_STRIPEBLOCKS];
+	struct kprof_count ks_counts[KPROF_NSITES];
+};
+
+/* Return address for each site slot, or 0 if unused. */
+static volatile vaddr_t kprof_sites[KPROF_NSITES];
+static struct spinlock kprof_sitelock = SPINLOCK_INITIALIZER;
+
+static struct kprof_stripe kprof_stripes[KPROF_NSTRIPES];
+
+/* Set up the free list and empty chains. Call with the lock held. */
+static
+void
+kprof_init(struct kprof_stripe *ks)
+{
+	unsigned i;
+
+	for (i=0; i<KPROF_STRIPEBUCKETS; i++) {
+		ks->ks_buckets[i] = KPROF_NONE;
+	}
+	for (i=0; i<KPROF_STRIPEBLOCKS; i++) {
+		ks->ks_blocks[i].kb_next =
+			(i+1 < KPROF_STRIPEBLOCKS) ? i+1 : KPROF_NONE;
+	}
+	ks->ks_freeblocks = 0;
+	ks->ks_initialized = true;
+}
+
+static
+unsigned
+kprof_hashptr(void *ptr)
+{
+	vaddr_t p = (vaddr_t)ptr;
+
+	return ((p >> 4) ^ (p >> 14)) % (KPROF_NSTRIPES * KPROF_STRIPEBUCKETS);
+}
+
+/*
+ * Find (or claim) the slot for SITE by open addressing; if the table
+ * is full, use KPROF_OTHER.
+ */
+static
+unsigned
+kprof_getsite(vaddr_t site)
+{
+	unsigned i, n, start;
+	vaddr_t cur;
+
+	start = ((site >> 2) * 2654435761U) % KPROF_NSITES;
+	for (n=0; n<KPROF_NSITES; n++) {
+		i = (start + n) % KPROF_NSITES;
+		if (i == KPROF_OTHER) {
+			continue;
+		}
+		cur = kprof_sites[i];
+		if (cur == 0) {
+			/* Someone else may be claiming it too. */
+			spinlock_acquire(&kprof_sitelock);
+			if (kprof_sites[i] == 0) {
+				kprof_sites[i] = site;
+			}
+			cur = kprof_sites[i];
+			spinlock_release(&kprof_sitelock);
+		}
+		if (cur == site) {
+			return i;
+		}
+	}
+	return KPROF_OTHER;
+}
+
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t site)
+{
+	struct kprof_stripe *ks;
+	struct kprof_count *kc;
+	struct kprof_block *kb;
+	unsigned s, b, h;
+
+	s = kprof_getsite(site);
+	h = kprof_hashptr(ptr);
+	ks = &kprof_stripes[h % KPROF_NSTRIPES];
+	h /= KPROF_NSTRIPES;
+
+	spinlock_acquire(&ks->ks_lock);
+	if (!ks->ks_initialized) {
+		kprof_init(ks);
+	}
+
+	b = ks->ks_freeblocks;
+	if (b == KPROF_NONE) {
+		ks->ks_untracked++;
+		spinlock_release(&ks->ks_lock);
+		return;
+	}
+	kb = &ks->ks_blocks[b];
+	ks->ks_freeblocks = kb->kb_next;
+
+	kc = &ks->ks_counts[s];
+	kc->kc_live += sz;
+	if (kc->kc_live > kc->kc_peak) {
+		kc->kc_peak = kc->kc_live;
+	}
+	kc->kc_blocks++;
+	kc->kc_allocs++;
+
+	kb->kb_ptr = ptr;
+	kb->kb_size = sz;
+	kb->kb_site = s;
+	kb->kb_next = ks->ks_buckets[h];
+	ks->ks_buckets[h] = b;
+
+	spinlock_release(&ks->ks_lock);
+}
+
+void
+kprof_free(void *ptr)
+{
+	struct kprof_stripe *ks;
+	struct kprof_count *kc;
+	struct kprof_block *kb;
+	uint16_t *bp;
+	unsigned h;
+
+	h = kprof_hashptr(ptr);
+	ks = &kprof_stripes[h % KPROF_NSTRIPES];
+	h /= KPROF_NSTRIPES;
+
+	spinlock_acquire(&ks->ks_lock);
+	if (!ks->ks_initialized) {
+		spinlock_release(&ks->ks_lock);
+		return;
+	}
+
+	for (bp = &ks->ks_buckets[h]; *bp != KPROF_NONE;
+	     bp = &ks->ks_blocks[*bp].kb_next) {
+		kb = &ks->ks_blocks[*bp];
+		if (kb->kb_ptr != ptr) {
+			continue;
+		}
+
+		kc = &ks->ks_counts[kb->kb_site];
+		KASSERT(kc->kc_live >= kb->kb_size && kc->kc_blocks > 0);
+		kc->kc_live -= kb->kb_size;
+		kc->kc_blocks--;
+
+		/* Unlink and put on the free list. */
+		*bp = kb->kb_next;
+		kb->kb_next = ks->ks_freeblocks;
+		ks->ks_freeblocks = kb - ks->ks_blocks;
+		break;
+	}
+	/* Not found means it was one of the untracked ones. */
+
+	spinlock_release(&ks->ks_lock);
+}
+
+/*
+ * Add up site SITE's counters over the stripes. Each stripe reaches
+ * its peak at its own time, so the sum of their peaks is only an
+ * upper bound on the site's.
+ */
+static
+void
+kprof_sum(unsigned site, struct kprof_count *kc)
+{
+	struct kprof_count *skc;
+	unsigned i;
+
+	kc->kc_live = kc->kc_peak = 0;
+	kc->kc_blocks = kc->kc_allocs = 0;
+	for (i=0; i<KPROF_NSTRIPES; i++) {
+		skc = &kprof_stripes[i].ks_counts[site];
+		kc->kc_live += skc->kc_live;
+		kc->kc_peak += skc->kc_peak;
+		kc->kc_blocks += skc->kc_blocks;
+		kc->kc_allocs += skc->kc_allocs;
+	}
+}
+
+void
+kprof_print(unsigned n)
+{
+	struct kprof_count kc, bestkc;
+	bool shown[KPROF_NSITES];
+	unsigned i, j, best, untracked;
+	size_t total;
+
+	/* Not worth locking for a printout; counts may be slightly off. */
+	total = 0;
+	for (i=0; i<KPROF_NSITES; i++) {
+		shown[i] = false;
+		kprof_sum(i, &kc);
+		total += kc.kc_live;
+	}
+	untracked = 0;
+	for (i=0; i<KPROF_NSTRIPES; i++) {
+		untracked += kprof_stripes[i].ks_untracked;
+	}
+
+	kprintf("kmalloc profile: %lu bytes live", (unsigned long)total);
+	if (untracked > 0) {
+		kprintf(" (plus %u allocations untracked)", untracked);
+	}
+	kprintf("\n");
+	kprintf("  %-10s %10s %8s %10s %10s\n",
+		"site", "live", "blocks", "peak", "allocs");
+
+	for (j=0; j<n; j++) {
+		best = KPROF_NSITES;
+		for (i=0; i<KPROF_NSITES; i++) {
+			if (shown[i]) {
+				continue;
+			}
+			kprof_sum(i, &kc);
+			if (kc.kc_allocs == 0) {
+				continue;
+			}
+			if (best == KPROF_NSITES || kc.kc_live > bestkc.kc_live) {
+				best = i;
+				bestkc = kc;
+			}
+		}
+		if (best == KPROF_NSITES) {
+			break;
+		}
+		shown[best] = true;
+
+		if (best == KPROF_OTHER) {
+			kprintf("  %-10s", "(other)");
+		}
+		else {
+			kprintf("  0x%08lx", (unsigned long)kprof_sites[best]);
+		}
+		kprintf(" %10lu %8u %10lu %10u\n",
+			(unsigned long)bestkc.kc_live, bestkc.kc_blocks,
+			(unsigned long)bestkc.kc_peak, bestkc.kc_allocs);
+	}
+}
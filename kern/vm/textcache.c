@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Text page cache. See textcache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <textcache.h>
+
+/* Number of hash chains. */
+#define TEXTCACHE_NBUCKETS	64
+
+struct textpage {
+	struct textpage *tp_next;	/* hash chain */
+	struct vnode *tp_vnode;
+	off_t tp_offset;
+	unsigned tp_start;
+	unsigned tp_end;
+	paddr_t tp_paddr;
+};
+
+static struct textpage *textcache[TEXTCACHE_NBUCKETS];
+
+/*
+ * Protects the hash table. Taken before the coremap's lock, so that a
+ * page found here can be given a reference before anyone can reclaim
+ * it.
+ */
+static struct spinlock textcache_lock = SPINLOCK_NAMED_INITIALIZER("textcache");
+
+/* Bucket to look at next in textcache_reclaim. */
+static unsigned textcache_hand;
+
+static
+unsigned
+textcache_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+		% TEXTCACHE_NBUCKETS;
+}
+
+/*
+ * Find a page. Call with the lock held.
+ */
+static
+struct textpage *
+textcache_find(struct vnode *v, off_t offset, unsigned start, unsigned end)
+{
+	struct textpage *tp;
+
+	for (tp = textcache[textcache_hash(v, offset)];
+	     tp != NULL;
+	     tp = tp->tp_next) {
+		if (tp->tp_vnode == v && tp->tp_offset == offset &&
+		    tp->tp_start == start && tp->tp_end == end) {
+			return tp;
+		}
+	}
+	return NULL;
+}
+
+paddr_t
+textcache_lookup(struct vnode *v, off_t offset, unsigned start, unsigned end)
+{
+	struct textpage *tp;
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&textcache_lock);
+	tp = textcache_find(v, offset, start, end);
+	if (tp != NULL) {
+		paddr = tp->tp_paddr;
+		coremap_share(paddr);
+	}
+	spinlock_release(&textcache_lock);
+
+	return paddr;
+}
+
+paddr_t
+textcache_insert(struct vnode *v, off_t offset, unsigned start, unsigned end,
+		 paddr_t paddr)
+{
+	struct textpage *tp, *new;
+	unsigned bucket;
+
+	KASSERT(start < end && end <= PAGE_SIZE);
+
+	new = kmalloc(sizeof(struct textpage));
+	if (new == NULL) {
+		/* Not the end of the world; the page just isn't shared. */
+		return paddr;
+	}
+
+	spinlock_acquire(&textcache_lock);
+	tp = textcache_find(v, offset, start, end);
+	if (tp != NULL) {
+		/* Lost the race. */
+		coremap_share(tp->tp_paddr);
+		paddr = tp->tp_paddr;
+		spinlock_release(&textcache_lock);
+		kfree(new);
+		return paddr;
+	}
+
+	VOP_INCREF(v);
+	coremap_share(paddr);
+	new->tp_vnode = v;
+	new->tp_offset = offset;
+	new->tp_start = start;
+	new->tp_end = end;
+	new->tp_paddr = paddr;
+	bucket = textcache_hash(v, offset);
+	new->tp_next = textcache[bucket];
+	textcache[bucket] = new;
+	spinlock_release(&textcache_lock);
+
+	return paddr;
+}
+
+bool
+textcache_reclaim(void)
+{
+	struct textpage *tp, **prev;
+	unsigned i;
+
+	spinlock_acquire(&textcache_lock);
+	for (i=0; i<TEXTCACHE_NBUCKETS; i++) {
+		prev = &textcache[textcache_hand];
+		textcache_hand = (textcache_hand + 1) % TEXTCACHE_NBUCKETS;
+
+		for (tp = *prev; tp != NULL; prev = &tp->tp_next, tp = *prev) {
+			/*
+			 * Only we can add references, so if ours is the
+			 * only one left it stays that way.
+			 */
+			if (coremap_refcount(tp->tp_paddr) == 1) {
+				*prev = tp->tp_next;
+				spinlock_release(&textcache_lock);
+
+				free_kpages(PADDR_TO_KVADDR(tp->tp_paddr));
+				VOP_DECREF(tp->tp_vnode);
+				kfree(tp);
+				return true;
+			}
+		}
+	}
+	spinlock_release(&textcache_lock);
+
+	return false;
+}
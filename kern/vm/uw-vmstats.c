@@ -33,6 +33,14 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Shootdowns",
+ /* 11 */ "TLB Shootdown IPIs",
+ /* 12 */ "TLB Shootdowns (Flush All)",
+ /* 13 */ "TLB Shootdown Wait (usec)",
+ /* 14 */ "Fault-around Preloads",
+ /* 15 */ "Fault-around Preloads Writeable",
+ /* 16 */ "Zero Pool Hits",
+ /* 17 */ "Zero Pool Misses",
 };
 
 
@@ -46,6 +54,17 @@ vmstats_inc(unsigned int index)
     spinlock_release(&stats_lock);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int amount)
+{
+    spinlock_acquire(&stats_lock);
+      KASSERT(index < VMSTAT_COUNT);
+      stats_counts[index] += amount;
+    spinlock_release(&stats_lock);
+}
+
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
@@ -133,5 +152,16 @@ vmstats_print(void)
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  if (stats_counts[VMSTAT_TLB_SHOOTDOWN] > 0) {
+    kprintf("VMSTAT TLB Shootdown Wait per Shootdown (usec) = %d\n",
+      stats_counts[VMSTAT_TLB_SHOOTDOWN_USEC] / stats_counts[VMSTAT_TLB_SHOOTDOWN]);
+  }
+
+  if (stats_counts[VMSTAT_ZEROPOOL_HIT] + stats_counts[VMSTAT_ZEROPOOL_MISS] > 0) {
+    kprintf("VMSTAT Zero Pool Hit Rate (%%) = %d\n",
+      stats_counts[VMSTAT_ZEROPOOL_HIT] * 100 /
+        (stats_counts[VMSTAT_ZEROPOOL_HIT] + stats_counts[VMSTAT_ZEROPOOL_MISS]));
+  }
 }
 /* ---------------------------------------------------------------------- */
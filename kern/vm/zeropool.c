@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Pool of pre-zeroed page frames. See zeropool.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <uw-vmstats.h>
+#include <zeropool.h>
+
+static paddr_t zeropool[ZEROPOOL_MAX];
+static unsigned zeropool_count;
+static unsigned zeropool_lowat = ZEROPOOL_LOWAT_DEFAULT;
+static unsigned zeropool_hiwat = ZEROPOOL_HIWAT_DEFAULT;
+
+/* True from when the pool drops below the low watermark until it's full. */
+static bool zeropool_filling = true;
+
+/* Protects all of the above. Taken before the coremap's lock. */
+static struct spinlock zeropool_lock = SPINLOCK_NAMED_INITIALIZER("zeropool");
+
+paddr_t
+zeropool_get(void)
+{
+	paddr_t paddr;
+
+	paddr = 0;
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count > 0) {
+		paddr = zeropool[--zeropool_count];
+	}
+	if (zeropool_count < zeropool_lowat) {
+		zeropool_filling = true;
+	}
+	spinlock_release(&zeropool_lock);
+
+	vmstats_inc(paddr != 0 ? VMSTAT_ZEROPOOL_HIT : VMSTAT_ZEROPOOL_MISS);
+	return paddr;
+}
+
+bool
+zeropool_refill(void)
+{
+	paddr_t paddr;
+	bool full;
+
+	if (!coremap_ready()) {
+		return false;
+	}
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count >= zeropool_hiwat) {
+		zeropool_filling = false;
+	}
+	full = !zeropool_filling;
+	spinlock_release(&zeropool_lock);
+	if (full) {
+		return false;
+	}
+
+	paddr = coremap_alloc(1);
+	if (paddr == 0) {
+		/* Memory is tight; wait until the pool is used again. */
+		spinlock_acquire(&zeropool_lock);
+		zeropool_filling = false;
+		spinlock_release(&zeropool_lock);
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count < zeropool_hiwat) {
+		zeropool[zeropool_count++] = paddr;
+		paddr = 0;
+	}
+	spinlock_release(&zeropool_lock);
+
+	if (paddr != 0) {
+		/* Another cpu filled it first. */
+		coremap_free(paddr);
+	}
+	return true;
+}
+
+/*
+ * Give back all but KEEP frames. Also stops refilling until the pool
+ * is next used.
+ */
+static
+bool
+zeropool_trim(unsigned keep)
+{
+	bool any;
+
+	any = false;
+	spinlock_acquire(&zeropool_lock);
+	while (zeropool_count > keep) {
+		coremap_free(zeropool[--zeropool_count]);
+		any = true;
+	}
+	zeropool_filling = false;
+	spinlock_release(&zeropool_lock);
+	return any;
+}
+
+bool
+zeropool_reclaim(void)
+{
+	return zeropool_trim(0);
+}
+
+int
+zeropool_setwat(unsigned lowat, unsigned hiwat)
+{
+	if (lowat > hiwat || hiwat > ZEROPOOL_MAX) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&zeropool_lock);
+	zeropool_lowat = lowat;
+	zeropool_hiwat = hiwat;
+	spinlock_release(&zeropool_lock);
+
+	zeropool_trim(hiwat);
+
+	spinlock_acquire(&zeropool_lock);
+	zeropool_filling = zeropool_count < zeropool_lowat;
+	spinlock_release(&zeropool_lock);
+	return 0;
+}
+
+void
+zeropool_printstats(void)
+{
+	/* Not worth locking for a printout. */
+	kprintf("Zero pool: %u pages (low watermark %u, high watermark %u)%s\n",
+		zeropool_count, zeropool_lowat, zeropool_hiwat,
+		zeropool_filling ? ", refilling" : "");
+}